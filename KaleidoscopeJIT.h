@@ -0,0 +1,738 @@
+//===- KaleidoscopeJIT.h - A simple JIT for Kaleidoscope --------*- C++ -*-===//
+//
+// The JIT used by toy.cpp.  It started as the tutorial's KaleidoscopeJIT and
+// adds a pool of compile threads, plus an optimization hook that runs on them,
+// so that modules are optimized and compiled off the REPL thread, a lazy
+// path that defers both until a function is first called, and an on-disk
+// object cache that skips both for modules compiled by an earlier run.  JIT'd
+// code can be made visible to GDB and perf.  A function can be called through
+// an indirect stub instead, so that its body can be swapped without touching
+// its callers.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_JIT_H
+#define KALEIDOSCOPE_JIT_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace llvm
+{
+    namespace orc
+    {
+
+        /// handleLazyCallThroughError - Called from a lazy stub whose body
+        /// failed to compile.
+        static void handleLazyCallThroughError()
+        {
+            errs() << "LazyCallThrough error: Could not find function body";
+            exit(1);
+        }
+
+        /// DiskObjectCache - Keeps compiled objects as files in a directory,
+        /// named by a hash of the module's IR before optimization, the
+        /// optimization pipeline and the target.  A module that hits is
+        /// neither optimized nor compiled.  Disabled until given a directory.
+        class DiskObjectCache : public ObjectCache
+        {
+            std::string Dir;
+            std::string TargetID;
+            std::atomic<unsigned> Hits{0}, Misses{0};
+
+            /// Loaded - Objects read by assignKey, held for getObject.  A
+            /// module that hit is left unoptimized, so it must be given the
+            /// very object that was found rather than compiled should the
+            /// file have gone away since.  Entries carry their key, as a
+            /// module dropped before it is compiled leaves its entry behind
+            /// for a later module at the same address.
+            std::mutex LoadedMutex;
+            DenseMap<const Module *,
+                     std::pair<std::string, std::unique_ptr<MemoryBuffer>>>
+                Loaded;
+
+            /// getKey - The key assignKey stored in M, or "" if it has none.
+            static StringRef getKey(const Module *M)
+            {
+                auto *Key = M->getNamedMetadata(KeyMetadataName);
+                if (!Key || Key->getNumOperands() != 1)
+                    return "";
+                return cast<MDString>(Key->getOperand(0)->getOperand(0))
+                    ->getString();
+            }
+
+            std::string getPath(StringRef Key) const
+            {
+                SmallString<128> Path(Dir);
+                sys::path::append(Path, Key + ".o");
+                return std::string(Path.str());
+            }
+
+        public:
+            static constexpr const char *KeyMetadataName =
+                "kaleidoscope.object.key";
+
+            DiskObjectCache(std::string TargetID) : TargetID(std::move(TargetID)) {}
+
+            Error setDirectory(StringRef Path)
+            {
+                if (auto EC = sys::fs::create_directories(Path))
+                    return createFileError(Path, EC);
+                Dir = Path.str();
+                return Error::success();
+            }
+
+            bool isEnabled() const { return !Dir.empty(); }
+            unsigned getNumHits() const { return Hits; }
+            unsigned getNumMisses() const { return Misses; }
+
+            /// assignKey - Hash M, which must not be optimized yet, together
+            /// with PipelineID and the target, and record the key in M for
+            /// getObject and notifyObjectCompiled.  Returns true if an object
+            /// for it is already cached, in which case it has been read for
+            /// getObject to return.
+            bool assignKey(Module &M, StringRef PipelineID)
+            {
+                SmallVector<char, 0> Bitcode;
+                raw_svector_ostream OS(Bitcode);
+                WriteBitcodeToFile(M, OS);
+
+                SHA1 Hasher;
+                Hasher.update(StringRef(Bitcode.data(), Bitcode.size()));
+                Hasher.update(PipelineID);
+                Hasher.update(TargetID);
+                std::string Key = toHex(Hasher.final(), /*LowerCase=*/true);
+
+                LLVMContext &Ctx = M.getContext();
+                auto *Node = M.getOrInsertNamedMetadata(KeyMetadataName);
+                Node->clearOperands();
+                Node->addOperand(MDNode::get(Ctx, MDString::get(Ctx, Key)));
+
+                auto Buf = MemoryBuffer::getFile(getPath(Key));
+                if (!Buf)
+                    return false;
+                std::lock_guard<std::mutex> Lock(LoadedMutex);
+                Loaded[&M] = {std::move(Key), std::move(*Buf)};
+                return true;
+            }
+
+            std::unique_ptr<MemoryBuffer> getObject(const Module *M) override
+            {
+                if (!isEnabled())
+                    return nullptr;
+                StringRef Key = getKey(M);
+                std::unique_ptr<MemoryBuffer> Buf;
+                {
+                    std::lock_guard<std::mutex> Lock(LoadedMutex);
+                    auto LI = Loaded.find(M);
+                    if (LI != Loaded.end())
+                    {
+                        if (LI->second.first == Key)
+                            Buf = std::move(LI->second.second);
+                        Loaded.erase(LI);
+                    }
+                }
+                // A module that missed was optimized, so an object another
+                // process has cached since is as good as compiling it.
+                if (!Buf && !Key.empty())
+                    if (auto File = MemoryBuffer::getFile(getPath(Key)))
+                        Buf = std::move(*File);
+                if (Buf)
+                    ++Hits;
+                return Buf;
+            }
+
+            void notifyObjectCompiled(const Module *M,
+                                      MemoryBufferRef Obj) override
+            {
+                StringRef Key = getKey(M);
+                if (!isEnabled() || Key.empty())
+                    return;
+                ++Misses;
+
+                // Write to a temporary and rename it into place, so that
+                // concurrent compiles and processes never see half an object.
+                int FD;
+                SmallString<128> TmpPath;
+                if (sys::fs::createUniqueFile(getPath(Key) + ".%%%%%%.tmp", FD,
+                                              TmpPath))
+                    return;
+                {
+                    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+                    OS << Obj.getBuffer();
+                }
+                if (sys::fs::rename(TmpPath, getPath(Key)))
+                    sys::fs::remove(TmpPath);
+            }
+        };
+
+        /// CountingMemoryMapper - Maps memory for SectionMemoryManager the way
+        /// its default mapper does, and counts the bytes mapped on each
+        /// thread.  RuntimeDyld allocates an object's sections and reports it
+        /// loaded on the same thread, with no other object loaded in between,
+        /// so the count taken when it is reported is what the object cost.
+        /// Every object gets its own memory manager, so that is whole pages
+        /// for each kind of section it has.
+        class CountingMemoryMapper : public SectionMemoryManager::MemoryMapper
+        {
+            /// getMappedBytes - The count for the calling thread.
+            static size_t &getMappedBytes()
+            {
+                static thread_local size_t Bytes = 0;
+                return Bytes;
+            }
+
+        public:
+            /// takeMappedBytes - Bytes mapped on this thread since the last
+            /// call.
+            static size_t takeMappedBytes() { return std::exchange(getMappedBytes(), 0); }
+
+            sys::MemoryBlock
+            allocateMappedMemory(SectionMemoryManager::AllocationPurpose,
+                                 size_t NumBytes,
+                                 const sys::MemoryBlock *const NearBlock,
+                                 unsigned Flags, std::error_code &EC) override
+            {
+                auto Block =
+                    sys::Memory::allocateMappedMemory(NumBytes, NearBlock, Flags, EC);
+                if (!EC)
+                    getMappedBytes() += Block.allocatedSize();
+                return Block;
+            }
+
+            std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                                unsigned Flags) override
+            {
+                return sys::Memory::protectMappedMemory(Block, Flags);
+            }
+
+            std::error_code releaseMappedMemory(sys::MemoryBlock &M) override
+            {
+                return sys::Memory::releaseMappedMemory(M);
+            }
+        };
+
+        /// PerfMapListener - Appends the address, size and name of every
+        /// function the JIT loads to /tmp/perf-<pid>.map, where perf looks for
+        /// symbols of anonymous executable memory.  The map is append-only, so
+        /// freed code keeps its entry until perf sees a later one there.
+        class PerfMapListener : public JITEventListener
+        {
+            std::mutex Mutex;
+            raw_fd_ostream OS;
+
+        public:
+            PerfMapListener(int FD) : OS(FD, /*shouldClose=*/true) {}
+
+            static Expected<std::unique_ptr<PerfMapListener>> Create()
+            {
+                SmallString<32> Path;
+                raw_svector_ostream(Path)
+                    << "/tmp/perf-" << sys::Process::getProcessId() << ".map";
+                int FD;
+                if (auto EC = sys::fs::openFileForWrite(Path, FD,
+                                                        sys::fs::CD_CreateAlways,
+                                                        sys::fs::OF_Text))
+                    return createFileError(Path, EC);
+                return std::make_unique<PerfMapListener>(FD);
+            }
+
+            void notifyObjectLoaded(ObjectKey,
+                                    const object::ObjectFile &Obj,
+                                    const RuntimeDyld::LoadedObjectInfo &L) override
+            {
+                // The debug object's sections are at their load addresses.
+                auto DebugObj = L.getObjectForDebug(Obj);
+                if (!DebugObj.getBinary())
+                    return;
+
+                std::lock_guard<std::mutex> Lock(Mutex);
+                for (const auto &P :
+                     object::computeSymbolSizes(*DebugObj.getBinary()))
+                {
+                    const object::SymbolRef &Sym = P.first;
+                    uint64_t Size = P.second;
+                    auto Type = Sym.getType();
+                    auto Name = Sym.getName();
+                    auto Addr = Sym.getAddress();
+                    if (Type && Name && Addr &&
+                        *Type == object::SymbolRef::ST_Function && Size)
+                        OS << format_hex_no_prefix(*Addr, 1) << ' '
+                           << format_hex_no_prefix(Size, 1) << ' ' << *Name
+                           << '\n';
+                    consumeError(Type.takeError());
+                    consumeError(Name.takeError());
+                    consumeError(Addr.takeError());
+                }
+                OS.flush();
+            }
+        };
+
+        class KaleidoscopeJIT
+        {
+        public:
+            /// OptimizeFunction - Applied to every module as part of compiling
+            /// it, on whichever thread materializes the module.  Must be safe to
+            /// call concurrently for modules in different contexts.  An error
+            /// fails the module's materialization.
+            using OptimizeFunction = std::function<Error(Module &)>;
+
+        private:
+            std::unique_ptr<ExecutionSession> ES;
+            std::unique_ptr<ThreadPool> CompileThreads;
+
+            DataLayout DL;
+            MangleAndInterner Mangle;
+            DiskObjectCache ObjCache;
+            std::unique_ptr<PerfMapListener> PerfMap;
+            CountingMemoryMapper Mapper;
+
+            RTDyldObjectLinkingLayer ObjectLayer;
+            IRCompileLayer CompileLayer;
+            IRTransformLayer OptimizeLayer;
+            OptimizeFunction Optimize;
+            std::string OptimizeID;
+
+            std::unique_ptr<LazyCallThroughManager> LCTMgr;
+            CompileOnDemandLayer CODLayer;
+
+            /// Stubs/StubTargets - The indirect stubs redirect defines, and
+            /// the body each one is meant to reach now.
+            std::unique_ptr<IndirectStubsManager> Stubs;
+            std::mutex StubsMutex;
+            StringMap<std::string> StubTargets;
+
+            JITDylib &MainJD;
+
+            /// DefsRT - Tracks modules added without a tracker of their own,
+            /// so replaceDefinitions can remove them all at once.
+            ResourceTrackerSP DefsRT;
+
+            /// InFlight - Materializations running on the pool, by tracker.
+            /// The object layer files an emitted object under its tracker only
+            /// after the lookup waiting for it has returned, so a tracker
+            /// must not be removed until its count drops to zero.
+            std::mutex InFlightMutex;
+            std::condition_variable InFlightDone;
+            DenseMap<ResourceKey, unsigned> InFlight;
+
+            /// getTaskKeys - The trackers of the materializations started by
+            /// the task running on the calling thread.
+            static SmallVectorImpl<ResourceKey> &getTaskKeys()
+            {
+                static thread_local SmallVector<ResourceKey, 2> TaskKeys;
+                return TaskKeys;
+            }
+
+            /// LoadedBytes - Memory mapped for the objects loaded under each
+            /// tracker.
+            std::mutex LoadedMutex;
+            DenseMap<ResourceKey, size_t> LoadedBytes;
+
+            /// finishTaskKeys - Retire the materializations the task that
+            /// just ran on this thread started.
+            void finishTaskKeys()
+            {
+                auto &TaskKeys = getTaskKeys();
+                if (TaskKeys.empty())
+                    return;
+                {
+                    std::lock_guard<std::mutex> Lock(InFlightMutex);
+                    for (ResourceKey K : TaskKeys)
+                        if (--InFlight[K] == 0)
+                            InFlight.erase(K);
+                }
+                TaskKeys.clear();
+                InFlightDone.notify_all();
+            }
+
+        public:
+            KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
+                            std::unique_ptr<LazyCallThroughManager> LCTMgr,
+                            JITTargetMachineBuilder JTMB, DataLayout DL,
+                            unsigned NumCompileThreads)
+                : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+                  ObjCache(JTMB.getTargetTriple().str() + "/" + JTMB.getCPU() +
+                           "/" + JTMB.getFeatures().getString()),
+                  ObjectLayer(*this->ES,
+                              [this]()
+                              {
+                                  return std::make_unique<SectionMemoryManager>(
+                                      &Mapper);
+                              }),
+                  CompileLayer(*this->ES, ObjectLayer,
+                               std::make_unique<ConcurrentIRCompiler>(std::move(JTMB),
+                                                                      &ObjCache)),
+                  OptimizeLayer(*this->ES, CompileLayer),
+                  LCTMgr(std::move(LCTMgr)),
+                  CODLayer(*this->ES, OptimizeLayer, *this->LCTMgr,
+                           createLocalIndirectStubsManagerBuilder(
+                               this->ES->getExecutorProcessControl()
+                                   .getTargetTriple())),
+                  Stubs(createLocalIndirectStubsManagerBuilder(
+                      this->ES->getExecutorProcessControl().getTargetTriple())()),
+                  MainJD(this->ES->createBareJITDylib("<main>")),
+                  DefsRT(MainJD.createResourceTracker())
+            {
+                MainJD.addGenerator(
+                    cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                        this->DL.getGlobalPrefix())));
+
+                // Objects are loaded before their symbols are resolved, so a
+                // lookup that returns has seen its module counted.
+                ObjectLayer.setNotifyLoaded(
+                    [this](MaterializationResponsibility &R,
+                           const object::ObjectFile &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &L)
+                    {
+                        size_t Bytes = CountingMemoryMapper::takeMappedBytes();
+                        if (auto Err = R.withResourceKeyDo(
+                                [&](ResourceKey K)
+                                {
+                                    std::lock_guard<std::mutex> Lock(LoadedMutex);
+                                    LoadedBytes[K] += Bytes;
+                                }))
+                            consumeError(std::move(Err));
+                    });
+
+                OptimizeLayer.setTransform(
+                    [this](ThreadSafeModule TSM, MaterializationResponsibility &R)
+                        -> Expected<ThreadSafeModule>
+                    {
+                        if (CompileThreads)
+                            if (auto Err = R.withResourceKeyDo(
+                                    [this](ResourceKey K)
+                                    {
+                                        std::lock_guard<std::mutex> Lock(
+                                            InFlightMutex);
+                                        ++InFlight[K];
+                                        getTaskKeys().push_back(K);
+                                    }))
+                                return std::move(Err);
+                        if (auto Err = TSM.withModuleDo(
+                                [this](Module &M) -> Error
+                                {
+                                    // Key the object on the IR as it arrives,
+                                    // so that a hit skips optimization too.
+                                    bool Cached =
+                                        ObjCache.isEnabled() &&
+                                        ObjCache.assignKey(M, OptimizeID);
+                                    if (Optimize && !Cached)
+                                        return Optimize(M);
+                                    return Error::success();
+                                }))
+                            return std::move(Err);
+                        return std::move(TSM);
+                    });
+
+                // Hand materialization work to the pool.  Lookups then only
+                // block on the definitions they actually depend on.
+                if (NumCompileThreads > 0)
+                {
+                    CompileThreads = std::make_unique<ThreadPool>(
+                        hardware_concurrency(NumCompileThreads));
+                    this->ES->setDispatchTask(
+                        [this](std::unique_ptr<Task> T)
+                        {
+                            // ThreadPool::async wants a copyable callable, and
+                            // a shared task is freed even if it never runs.
+                            CompileThreads->async(
+                                [this, T = std::shared_ptr<Task>(
+                                           std::move(T))]() mutable
+                                {
+                                    T->run();
+                                    T.reset();
+                                    finishTaskKeys();
+                                });
+                        });
+                }
+            }
+
+            ~KaleidoscopeJIT()
+            {
+                if (CompileThreads)
+                    CompileThreads->wait();
+                if (auto Err = ES->endSession())
+                    ES->reportError(std::move(Err));
+            }
+
+            static Expected<std::unique_ptr<KaleidoscopeJIT>>
+            Create(unsigned NumCompileThreads = 0)
+            {
+                auto EPC = SelfExecutorProcessControl::Create();
+                if (!EPC)
+                    return EPC.takeError();
+
+                auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+
+                auto LCTMgr = createLocalLazyCallThroughManager(
+                    ES->getExecutorProcessControl().getTargetTriple(), *ES,
+                    pointerToJITTargetAddress(&handleLazyCallThroughError));
+                if (!LCTMgr)
+                    return LCTMgr.takeError();
+
+                // Compile for the host CPU, so generated code can use all of
+                // its vector and FMA instructions.
+                auto JTMB = JITTargetMachineBuilder::detectHost();
+                if (!JTMB)
+                    return JTMB.takeError();
+
+                auto DL = JTMB->getDefaultDataLayoutForTarget();
+                if (!DL)
+                    return DL.takeError();
+
+                return std::make_unique<KaleidoscopeJIT>(
+                    std::move(ES), std::move(*LCTMgr), std::move(*JTMB),
+                    std::move(*DL), NumCompileThreads);
+            }
+
+            const DataLayout &getDataLayout() const { return DL; }
+
+            JITDylib &getMainJITDylib() { return MainJD; }
+
+            unsigned getNumCompileThreads() const
+            {
+                return CompileThreads ? CompileThreads->getThreadCount() : 0;
+            }
+
+            /// setOptimizer - Optimize each module as it is compiled, rather
+            /// than leaving it to the caller before addModule.  PipelineID
+            /// names what Fn does, and must change whenever its output can.
+            void setOptimizer(OptimizeFunction Fn, StringRef PipelineID)
+            {
+                Optimize = std::move(Fn);
+                OptimizeID = PipelineID.str();
+            }
+
+            /// enableObjectCache - Keep compiled objects in Dir, and reuse
+            /// them instead of optimizing and compiling identical modules.
+            /// Only modules optimized by the JIT itself are safe to key, so
+            /// use this together with setOptimizer.
+            Error enableObjectCache(StringRef Dir)
+            {
+                return ObjCache.setDirectory(Dir);
+            }
+
+            const DiskObjectCache &getObjectCache() const { return ObjCache; }
+
+            /// enableDebuggerSupport - Register code loaded from now on with
+            /// GDB's JIT interface.
+            void enableDebuggerSupport()
+            {
+                ObjectLayer.registerJITEventListener(
+                    *JITEventListener::createGDBRegistrationListener());
+            }
+
+            /// enablePerfMap - Name code loaded from now on in a perf map.
+            Error enablePerfMap()
+            {
+                auto Listener = PerfMapListener::Create();
+                if (!Listener)
+                    return Listener.takeError();
+                PerfMap = std::move(*Listener);
+                ObjectLayer.registerJITEventListener(*PerfMap);
+                return Error::success();
+            }
+
+            /// enablePerfJITDump - Record code loaded from now on in a jitdump
+            /// file for 'perf inject --jit', which also keeps the code bytes.
+            /// The makefile defines KALEIDOSCOPE_PERF_JIT_EVENTS when LLVM has
+            /// the perfjitevents library to link.
+            Error enablePerfJITDump()
+            {
+                JITEventListener *Listener = nullptr;
+#ifdef KALEIDOSCOPE_PERF_JIT_EVENTS
+                Listener = JITEventListener::createPerfJITEventListener();
+#endif
+                if (!Listener)
+                    return createStringError(inconvertibleErrorCode(),
+                                             "LLVM was built without perf "
+                                             "JIT support");
+                ObjectLayer.registerJITEventListener(*Listener);
+                return Error::success();
+            }
+
+            Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr)
+            {
+                if (!RT)
+                    RT = DefsRT;
+                return OptimizeLayer.add(RT, std::move(TSM));
+            }
+
+            /// replaceDefinitions - Remove every module added without a
+            /// tracker of its own, and add TSM in their place.  Nothing may
+            /// run code from the old modules afterwards.
+            Error replaceDefinitions(ThreadSafeModule TSM)
+            {
+                // Let background compiles of the old modules finish, rather
+                // than fail when their tracker disappears.
+                if (CompileThreads)
+                    CompileThreads->wait();
+                if (auto Err = removeModule(DefsRT))
+                    return Err;
+                DefsRT = MainJD.createResourceTracker();
+                return addModule(std::move(TSM));
+            }
+
+            /// removeModule - Free everything added under RT, once the pool
+            /// has finished materializing it.
+            Error removeModule(ResourceTrackerSP RT)
+            {
+                {
+                    std::unique_lock<std::mutex> Lock(InFlightMutex);
+                    ResourceKey K = RT->getKeyUnsafe();
+                    InFlightDone.wait(Lock, [&] { return !InFlight.count(K); });
+                }
+                {
+                    std::lock_guard<std::mutex> Lock(LoadedMutex);
+                    LoadedBytes.erase(RT->getKeyUnsafe());
+                }
+                return RT->remove();
+            }
+
+            /// getLoadedBytes - Memory mapped for the code and data loaded for
+            /// RT so far.
+            size_t getLoadedBytes(const ResourceTracker &RT)
+            {
+                std::lock_guard<std::mutex> Lock(LoadedMutex);
+                return LoadedBytes.lookup(RT.getKeyUnsafe());
+            }
+
+            /// addLazyModule - Add TSM behind lazy-call-through stubs.  Each
+            /// function is optimized and compiled only when first called.
+            Error addLazyModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr)
+            {
+                if (!RT)
+                    RT = DefsRT;
+                return CODLayer.add(RT, std::move(TSM));
+            }
+
+            /// redirect - Make calls to Name reach Target from now on.  The
+            /// first redirect defines Name as an indirect stub, and later ones
+            /// repoint it, so code calling Name never needs recompiling.  The
+            /// stub goes through a lazy-call-through trampoline until Target
+            /// is first called, so Target may call functions not defined yet.
+            /// Each redirect keeps a trampoline for good.  Nothing may still
+            /// be running the old target when the module holding it is
+            /// removed.
+            Error redirect(StringRef Name, StringRef Target)
+            {
+                auto Trampoline = LCTMgr->getCallThroughTrampoline(
+                    MainJD, Mangle(Target),
+                    [this, Name = Name.str(),
+                     Target = Target.str()](JITTargetAddress Addr) -> Error
+                    {
+                        // Skip the trampoline from now on, unless Name was
+                        // redirected again while Target was compiled.
+                        std::lock_guard<std::mutex> Lock(StubsMutex);
+                        if (StubTargets.lookup(Name) != Target)
+                            return Error::success();
+                        return Stubs->updatePointer(Name, Addr);
+                    });
+                if (!Trampoline)
+                    return Trampoline.takeError();
+
+                std::lock_guard<std::mutex> Lock(StubsMutex);
+                auto Inserted = StubTargets.try_emplace(Name, Target.str());
+                if (!Inserted.second)
+                {
+                    Inserted.first->second = Target.str();
+                    return Stubs->updatePointer(Name, *Trampoline);
+                }
+                if (auto Err = Stubs->createStub(Name, *Trampoline,
+                                                 JITSymbolFlags::Exported |
+                                                     JITSymbolFlags::Callable))
+                    return Err;
+                return MainJD.define(absoluteSymbols(
+                    {{Mangle(Name), Stubs->findStub(Name, /*ExportedStubsOnly=*/true)}}));
+            }
+
+            Expected<JITEvaluatedSymbol> lookup(StringRef Name)
+            {
+                return ES->lookup({&MainJD}, Mangle(Name.str()));
+            }
+
+            /// lookupAsync - Like lookup, but returns at once and calls
+            /// OnResolved when Name is ready, on a compile thread if there are
+            /// any.
+            void lookupAsync(
+                StringRef Name,
+                unique_function<void(Expected<JITEvaluatedSymbol>)> OnResolved)
+            {
+                auto Sym = Mangle(Name);
+                ES->lookup(
+                    LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+                    SymbolLookupSet(Sym), SymbolState::Ready,
+                    [Sym, OnResolved = std::move(OnResolved)](
+                        Expected<SymbolMap> Result) mutable
+                    {
+                        if (!Result)
+                            return OnResolved(Result.takeError());
+                        OnResolved((*Result)[Sym]);
+                    },
+                    NoDependenciesToRegister);
+            }
+
+            /// compileAsync - Start optimizing and compiling the modules that
+            /// define Names without waiting for them.  Errors are reported
+            /// through the ExecutionSession.
+            void compileAsync(ArrayRef<StringRef> Names)
+            {
+                SymbolLookupSet Symbols;
+                for (StringRef Name : Names)
+                    Symbols.add(Mangle(Name));
+                ES->lookup(
+                    LookupKind::Static, makeJITDylibSearchOrder(&MainJD),
+                    std::move(Symbols), SymbolState::Ready,
+                    [this](Expected<SymbolMap> Result)
+                    {
+                        if (!Result)
+                            ES->reportError(Result.takeError());
+                    },
+                    NoDependenciesToRegister);
+            }
+        };
+
+    } // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_JIT_H
@@ -0,0 +1,31 @@
+//===- harness.cpp - Calls an AOT-compiled Kaleidoscope sample ------------===//
+//
+// Links against the object that "toy -emit=obj aot/sample.ks" produces.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdio>
+
+extern "C"
+{
+    double square(double);
+    double poly(double);
+    double score(double, double, double);
+    double report(double);
+
+    /// printd - The library function sample.ks declares with extern.
+    double printd(double X)
+    {
+        fprintf(stderr, "%f\n", X);
+        return 0;
+    }
+}
+
+int main()
+{
+    printf("square(3) = %f\n", square(3));
+    printf("poly(2) = %f\n", poly(2));
+    printf("score(1, 2, 3) = %f\n", score(1, 2, 3));
+    report(1);
+    return 0;
+}
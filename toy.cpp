@@ -1,34 +1,260 @@
-#include "../examples/Kaleidoscope/include/KaleidoscopeJIT.h"
+#include "KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileOutputBuffer.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 using namespace llvm;
 using namespace llvm::orc;
+//===----------------------------------------------------------------------===//
+// Input Sources
+//===----------------------------------------------------------------------===//
+
+namespace
+{
+
+    /// InputSource - A window of program text that the lexer scans in place.
+    /// The bytes in [getBufferStart(), getBufferEnd()) are contiguous; when the
+    /// lexer runs off the end it asks the source for more.
+    class InputSource
+    {
+    protected:
+        const char *BufStart = nullptr;
+        const char *BufEnd = nullptr;
+
+    public:
+        virtual ~InputSource() = default;
+
+        const char *getBufferStart() const { return BufStart; }
+        const char *getBufferEnd() const { return BufEnd; }
+
+        /// refill - Make more input available after getBufferEnd().  The bytes
+        /// from Keep onwards are preserved and Keep is updated to their new
+        /// location.  Returns false once the input is exhausted.
+        virtual bool refill(const char *&Keep) = 0;
+    };
+
+    /// MemoryInputSource - The whole program is already in memory: either a
+    /// file opened through MemoryBuffer, which mmaps anything larger than a
+    /// few pages, or a string handed to us by an embedder.
+    class MemoryInputSource : public InputSource
+    {
+        std::unique_ptr<MemoryBuffer> Buffer;
+
+    public:
+        MemoryInputSource(std::unique_ptr<MemoryBuffer> Buffer)
+            : Buffer(std::move(Buffer))
+        {
+            BufStart = this->Buffer->getBufferStart();
+            BufEnd = this->Buffer->getBufferEnd();
+        }
+
+        bool refill(const char *&Keep) override { return false; }
+    };
+
+    /// StreamInputSource - Reads stdin, a pipe or any other unmappable file in
+    /// large blocks.  A read returns as soon as some data is available, so an
+    /// interactive session still sees each line as soon as it is typed.
+    class StreamInputSource : public InputSource
+    {
+        static constexpr size_t BlockSize = 64 * 1024;
+
+        sys::fs::file_t File;
+        bool OwnsFile;
+        bool AtEOF = false;
+        std::vector<char> Storage;
+
+    public:
+        StreamInputSource(sys::fs::file_t File, bool OwnsFile)
+            : File(File), OwnsFile(OwnsFile), Storage(BlockSize)
+        {
+            BufStart = BufEnd = Storage.data();
+        }
+
+        ~StreamInputSource() override
+        {
+            if (OwnsFile)
+                sys::fs::closeFile(File);
+        }
+
+        bool refill(const char *&Keep) override;
+    };
+
+} // end anonymous namespace
+
+bool StreamInputSource::refill(const char *&Keep)
+{
+    // Slide the bytes we must keep to the front of the buffer, and grow it if
+    // a single token has eaten most of the space.
+    size_t Kept = BufEnd - Keep;
+    std::memmove(Storage.data(), Keep, Kept);
+    if (Storage.size() - Kept < BlockSize / 2)
+        Storage.resize(Storage.size() * 2);
+
+    size_t Read = 0;
+    if (!AtEOF)
+    {
+        auto ReadOrErr = sys::fs::readNativeFile(
+            File, makeMutableArrayRef(Storage.data() + Kept, Storage.size() - Kept));
+        if (ReadOrErr)
+            Read = *ReadOrErr;
+        else
+            logAllUnhandledErrors(ReadOrErr.takeError(), errs(), "Error: ");
+        AtEOF = Read == 0;
+    }
+
+    Keep = BufStart = Storage.data();
+    BufEnd = BufStart + Kept + Read;
+    return Read != 0;
+}
+
+/// createStringSource - Lex the given text, which must outlive the source.
+static std::unique_ptr<InputSource> createStringSource(StringRef Text)
+{
+    return std::make_unique<MemoryInputSource>(MemoryBuffer::getMemBuffer(
+        Text, "<string>", /*RequiresNullTerminator=*/false));
+}
+
+/// openInputSource - Open Filename ("-" for stdin) for lexing.  Regular files
+/// are mapped into memory in one go; everything else is streamed.
+static Expected<std::unique_ptr<InputSource>> openInputSource(StringRef Filename)
+{
+    if (Filename == "-")
+        return std::make_unique<StreamInputSource>(sys::fs::getStdinHandle(),
+                                                   /*OwnsFile=*/false);
+
+    if (sys::fs::is_regular_file(Filename))
+    {
+        auto BufOrErr = MemoryBuffer::getFile(Filename, /*IsText=*/false,
+                                              /*RequiresNullTerminator=*/false);
+        if (!BufOrErr)
+            return createFileError(Filename, BufOrErr.getError());
+        return std::make_unique<MemoryInputSource>(std::move(*BufOrErr));
+    }
+
+    auto FileOrErr = sys::fs::openNativeFileForRead(Filename);
+    if (!FileOrErr)
+        return createFileError(Filename, FileOrErr.takeError());
+    return std::make_unique<StreamInputSource>(*FileOrErr, /*OwnsFile=*/true);
+}
+
+//===----------------------------------------------------------------------===//
+// Symbols
+//===----------------------------------------------------------------------===//
+
+/// SymbolID - A small integer naming an interned identifier.
+using SymbolID = unsigned;
+
+/// Symbols that are interned up front, so keyword checks are integer compares.
+enum KnownSymbol : SymbolID
+{
+    sym_def,
+    sym_extern,
+    sym_anon_expr,
+    sym_binary,
+    sym_left,
+    sym_right,
+    sym_export
+};
+
+namespace
+{
+
+    /// SymbolTable - Interns each distinct identifier once, at lex time, so the
+    /// parser, AST and codegen compare and key maps on SymbolIDs rather than
+    /// hashing and copying strings.
+    class SymbolTable
+    {
+        StringMap<SymbolID> IDs;
+        std::vector<StringRef> Names; // Point at the keys owned by IDs.
+
+    public:
+        SymbolTable()
+        {
+            intern("def");
+            intern("extern");
+            intern("__anon_expr");
+            intern("binary");
+            intern("left");
+            intern("right");
+            intern("export");
+        }
+
+        SymbolID intern(StringRef Name)
+        {
+            auto Result = IDs.try_emplace(Name, Names.size());
+            if (Result.second)
+                Names.push_back(Result.first->getKey());
+            return Result.first->second;
+        }
+
+        StringRef getName(SymbolID ID) const { return Names[ID]; }
+    };
+
+} // end anonymous namespace
+
+static SymbolTable Symbols;
+
 //===----------------------------------------------------------------------===//
 // Lexer
 //===----------------------------------------------------------------------===//
@@ -45,43 +271,83 @@ enum Token
 
     // primary
     tok_identifier = -4,
-    tok_number = -5
+    tok_number = -5,
+
+    // operators
+    tok_binary = -6,
+
+    // visibility
+    tok_export = -7
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+static StringRef IdentifierStr; // Filled in if tok_identifier, valid until
+                                // the next gettok.
+static SymbolID IdentifierSym;  // Filled in if tok_identifier
+static double NumVal;           // Filled in if tok_number
 
-/// gettok - Return the next token from standard input.
-static int gettok()
+static std::unique_ptr<InputSource> TheSource; // Where gettok reads from.
+static const char *CurPtr;   // Next character to be lexed.
+static const char *TokStart; // First character of the token being lexed.
+
+/// setInputSource - Point the lexer at a new source of program text.
+static void setInputSource(std::unique_ptr<InputSource> Source)
 {
-    static int LastChar = ' ';
+    TheSource = std::move(Source);
+    CurPtr = TokStart = TheSource->getBufferStart();
+}
+
+/// peekChar - Return the character under the cursor without consuming it,
+/// pulling in more input when the buffer runs dry.  The partially lexed token
+/// starting at TokStart survives the refill.
+static int peekChar()
+{
+    if (CurPtr == TheSource->getBufferEnd())
+    {
+        size_t TokLen = CurPtr - TokStart;
+        bool MoreInput = TheSource->refill(TokStart);
+        CurPtr = TokStart + TokLen;
+        if (!MoreInput)
+            return EOF;
+    }
+    return (unsigned char)*CurPtr;
+}
 
+/// gettok - Return the next token from the current input source.
+static int gettok()
+{
     // Skip any whitespace.
-    while (isspace(LastChar))
-        LastChar = getchar();
+    TokStart = CurPtr;
+    while (isspace(peekChar()))
+        TokStart = ++CurPtr;
+
+    int LastChar = peekChar();
 
     if (isalpha(LastChar))
     { // identifier: [a-zA-Z][a-zA-Z0-9]*
-        IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar())))
-            IdentifierStr += LastChar;
+        ++CurPtr;
+        while (isalnum(peekChar()))
+            ++CurPtr;
+        IdentifierStr = StringRef(TokStart, CurPtr - TokStart);
+        IdentifierSym = Symbols.intern(IdentifierStr);
 
-        if (IdentifierStr == "def")
+        if (IdentifierSym == sym_def)
             return tok_def;
-        if (IdentifierStr == "extern")
+        if (IdentifierSym == sym_extern)
             return tok_extern;
+        if (IdentifierSym == sym_binary)
+            return tok_binary;
+        if (IdentifierSym == sym_export)
+            return tok_export;
         return tok_identifier;
     }
 
     if (isdigit(LastChar) || LastChar == '.')
     { // Number: [0-9.]+
-        std::string NumStr;
         do
-        {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
+            ++CurPtr;
+        while (isdigit(peekChar()) || peekChar() == '.');
 
+        SmallString<32> NumStr(TokStart, CurPtr);
         NumVal = strtod(NumStr.c_str(), nullptr);
         return tok_number;
     }
@@ -90,8 +356,10 @@ static int gettok()
     {
         // Comment until end of line.
         do
-            LastChar = getchar();
-        while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+        {
+            TokStart = ++CurPtr;
+            LastChar = peekChar();
+        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
         if (LastChar != EOF)
             return gettok();
@@ -102,9 +370,8 @@ static int gettok()
         return tok_eof;
 
     // Otherwise, just return the character as its ascii value.
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
+    ++CurPtr;
+    return LastChar;
 }
 
 //===----------------------------------------------------------------------===//
@@ -114,13 +381,41 @@ static int gettok()
 namespace
 {
 
-    /// ExprAST - Base class for all expression nodes.
+    struct FunctionRecord;
+
+    /// ExprAST - Base class for all expression nodes.  Nodes live in the AST
+    /// arena and are never destroyed individually, so the hierarchy must stay
+    /// trivially destructible.
     class ExprAST
     {
     public:
-        virtual ~ExprAST() = default;
+        /// Discriminator for LLVM-style RTTI (isa<>, dyn_cast<>).
+        enum ExprKind
+        {
+            EK_Number,
+            EK_Variable,
+            EK_Binary,
+            EK_Call
+        };
+
+    private:
+        const ExprKind Kind;
+
+    public:
+        ExprAST(ExprKind Kind) : Kind(Kind) {}
+        ~ExprAST() = default;
+
+        ExprKind getKind() const { return Kind; }
 
         virtual Value *codegen() = 0;
+
+        /// resolve - Bind variables to argument slots and calls to their
+        /// targets, reporting anything the interpreter could not run.
+        virtual bool resolve() = 0;
+
+        /// interpret - Evaluate the expression with the tier-0 interpreter.
+        /// Frame holds the values of the enclosing function's arguments.
+        virtual double interpret(const double *Frame) = 0;
     };
 
     /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -129,82 +424,353 @@ namespace
         double Val;
 
     public:
-        NumberExprAST(double Val) : Val(Val) {}
+        NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
 
         Value *codegen() override;
+        bool resolve() override { return true; }
+        double interpret(const double *Frame) override { return Val; }
+        double getVal() const { return Val; }
+
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
     };
 
     /// VariableExprAST - Expression class for referencing a variable, like "a".
     class VariableExprAST : public ExprAST
     {
-        std::string Name;
+        SymbolID Name;
+        unsigned Slot = 0; // Argument index, set by resolve.
 
     public:
-        VariableExprAST(const std::string &Name) : Name(Name) {}
+        VariableExprAST(SymbolID Name) : ExprAST(EK_Variable), Name(Name) {}
 
         Value *codegen() override;
+        bool resolve() override;
+        double interpret(const double *Frame) override { return Frame[Slot]; }
+        SymbolID getName() const { return Name; }
+
+        static bool classof(const ExprAST *E)
+        {
+            return E->getKind() == EK_Variable;
+        }
     };
 
     /// BinaryExprAST - Expression class for a binary operator.
     class BinaryExprAST : public ExprAST
     {
         char Op;
-        std::unique_ptr<ExprAST> LHS, RHS;
+        ExprAST *LHS, *RHS;
+        FunctionRecord *Target = nullptr; // User-defined operators only.
 
     public:
-        BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                      std::unique_ptr<ExprAST> RHS)
-            : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+        BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+            : ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
 
         Value *codegen() override;
+        bool resolve() override;
+        double interpret(const double *Frame) override;
+        char getOp() const { return Op; }
+        ExprAST *getLHS() const { return LHS; }
+        ExprAST *getRHS() const { return RHS; }
+
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
     };
 
     /// CallExprAST - Expression class for function calls.
     class CallExprAST : public ExprAST
     {
-        std::string Callee;
-        std::vector<std::unique_ptr<ExprAST>> Args;
+        SymbolID Callee;
+        ArrayRef<ExprAST *> Args; // Allocated in the AST arena.
+        FunctionRecord *Target = nullptr; // Set by resolve.
 
     public:
-        CallExprAST(const std::string &Callee,
-                    std::vector<std::unique_ptr<ExprAST>> Args)
-            : Callee(Callee), Args(std::move(Args)) {}
+        CallExprAST(SymbolID Callee, ArrayRef<ExprAST *> Args)
+            : ExprAST(EK_Call), Callee(Callee), Args(Args) {}
 
         Value *codegen() override;
+        bool resolve() override;
+        double interpret(const double *Frame) override;
+        SymbolID getCallee() const { return Callee; }
+        ArrayRef<ExprAST *> getArgs() const { return Args; }
+
+        static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+    };
+
+    /// Effects - What calling a function may do besides computing its result.
+    enum Effects
+    {
+        MayHaveSideEffects, // Unknown externs, such as printd, and their callers.
+        PureMayNotReturn,   // Arithmetic and pure calls only, but recursive.
+        Pure                // Arithmetic and pure calls only, and returns.
     };
 
     /// PrototypeAST - This class represents the "prototype" for a function,
     /// which captures its name, and its argument names (thus implicitly the number
-    /// of arguments the function takes).
+    /// of arguments the function takes), as well as if it is an operator.
     class PrototypeAST
     {
-        std::string Name;
-        std::vector<std::string> Args;
+        SymbolID Name;
+        std::vector<SymbolID> Args;
+        bool IsOperator;
+        unsigned Precedence; // Precedence if a binary op.
+        bool RightAssoc;     // Associativity if a binary op.
+        bool Extern = false; // Declared by 'extern' rather than a definition.
+        Effects Eff = MayHaveSideEffects; // Inferred for definitions.
 
     public:
-        PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-            : Name(Name), Args(std::move(Args)) {}
+        PrototypeAST(SymbolID Name, std::vector<SymbolID> Args,
+                     bool IsOperator = false, unsigned Prec = 0,
+                     bool RightAssoc = false)
+            : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
+              Precedence(Prec), RightAssoc(RightAssoc) {}
 
         Function *codegen();
-        const std::string &getName() const { return Name; }
+        SymbolID getName() const { return Name; }
+        ArrayRef<SymbolID> getArgs() const { return Args; }
+
+        bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
+        bool isExtern() const { return Extern; }
+        void setExtern() { Extern = true; }
+        Effects getEffects() const { return Eff; }
+        void setEffects(Effects E) { Eff = E; }
+
+        char getOperatorName() const
+        {
+            assert(isBinaryOp());
+            return Symbols.getName(Name).back();
+        }
+
+        unsigned getBinaryPrecedence() const { return Precedence; }
+        bool isRightAssoc() const { return RightAssoc; }
+    };
+
+    /// FPMode - How freely a function's arithmetic may be rewritten.
+    enum FPMode
+    {
+        FPStrict,   // IEEE semantics, rounding after every operation.
+        FPContract, // Multiply-adds may be fused, skipping one rounding.
+        FPFast      // All fast-math flags: reassociation, no NaNs or infs, ...
     };
 
     /// FunctionAST - This class represents a function definition itself.
     class FunctionAST
     {
-        std::unique_ptr<PrototypeAST> Proto;
-        std::unique_ptr<ExprAST> Body;
+        std::unique_ptr<PrototypeAST> Proto; // Moved to FunctionProtos by codegen.
+        ExprAST *Body;
+        SymbolID Name;
+        FPMode FP; // The session's mode when the definition was read.
+        bool Exported = false;
 
     public:
-        FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                    std::unique_ptr<ExprAST> Body)
-            : Proto(std::move(Proto)), Body(std::move(Body)) {}
+        FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body,
+                    FPMode FP = FPStrict)
+            : Proto(std::move(Proto)), Body(Body), Name(this->Proto->getName()),
+              FP(FP) {}
 
         Function *codegen();
+        SymbolID getName() const { return Name; }
+        ExprAST *getBody() const { return Body; }
+        PrototypeAST &getProto() const { return *Proto; }
+        FPMode getFPMode() const { return FP; }
+        bool isExported() const { return Exported; }
+        void setExported() { Exported = true; }
+    };
+
+} // end anonymous namespace
+
+static cl::opt<FPMode> FloatMode(
+    "fp-mode", cl::desc("Floating-point semantics of generated code"),
+    cl::values(clEnumValN(FPStrict, "strict", "IEEE arithmetic (the default)"),
+               clEnumValN(FPContract, "contract",
+                          "Fuse multiply-adds into FMAs"),
+               clEnumValN(FPFast, "fast", "Allow every fast-math rewrite")),
+    cl::init(FPStrict));
+
+/// ASTArena - Owns every expression node of the top-level item being parsed.
+/// MainLoop resets it once the item has been handled, releasing the whole tree
+/// at once instead of node by node.
+static BumpPtrAllocator ASTArena;
+
+/// newExpr - Allocate an expression node in the AST arena.
+template <typename T, typename... ArgTs> static T *newExpr(ArgTs &&...Args)
+{
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena nodes are never destroyed");
+    return new (ASTArena.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+}
+
+/// copyToArena - Copy a temporary list of nodes into the AST arena.
+static ArrayRef<ExprAST *> copyToArena(ArrayRef<ExprAST *> Nodes)
+{
+    ExprAST **Mem = ASTArena.Allocate<ExprAST *>(Nodes.size());
+    std::uninitialized_copy(Nodes.begin(), Nodes.end(), Mem);
+    return makeArrayRef(Mem, Nodes.size());
+}
+
+//===----------------------------------------------------------------------===//
+// Constant Folding
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool> FoldConstants(
+    "fold-constants",
+    cl::desc("Fold builtin operators on constants while parsing"),
+    cl::init(true));
+
+/// evalBuiltinBinop - Apply a builtin operator the way its codegen would.
+/// Returns None for user-defined operators, which only their body can run.
+static Optional<double> evalBuiltinBinop(char Op, double L, double R)
+{
+    switch (Op)
+    {
+    case '+':
+        return L + R;
+    case '-':
+        return L - R;
+    case '*':
+        return L * R;
+    case '<':
+        // Match codegen's fcmp ult, which is also true if either side is NaN.
+        return !(L >= R) ? 1.0 : 0.0;
+    default:
+        return None;
+    }
+}
+
+/// foldBinop - Build the node for "LHS Op RHS", folding it to a number when
+/// both sides are numbers and Op is builtin.  The parser builds bottom-up, so
+/// every constant subtree collapses as soon as it is complete, and a constant
+/// top-level expression arrives at the driver as a single NumberExprAST.
+static ExprAST *foldBinop(char Op, ExprAST *LHS, ExprAST *RHS)
+{
+    auto *L = dyn_cast<NumberExprAST>(LHS);
+    auto *R = dyn_cast<NumberExprAST>(RHS);
+    if (FoldConstants && L && R)
+        if (auto Val = evalBuiltinBinop(Op, L->getVal(), R->getVal()))
+            return newExpr<NumberExprAST>(*Val);
+    return newExpr<BinaryExprAST>(Op, LHS, RHS);
+}
+
+//===----------------------------------------------------------------------===//
+// Flat Expression Form
+//===----------------------------------------------------------------------===//
+
+namespace
+{
+
+    /// FlatExpr - A compact, index-based encoding of an expression tree.  Nodes
+    /// are stored structure-of-arrays in post-order, so every operand precedes
+    /// its user and codegen is one forward walk with a switch, rather than a
+    /// virtual call per pointer-linked node.
+    class FlatExpr
+    {
+    public:
+        enum Opcode : uint8_t
+        {
+            Const, // A: index into Constants.
+            Var,   // A: variable symbol.
+            BinOp, // A, B: LHS and RHS nodes.  C: operator character.
+            Call   // A: callee symbol.  B, C: first entry and count in CallArgs.
+        };
+
+    private:
+        std::vector<Opcode> Ops;
+        std::vector<uint32_t> A, B, C;
+        std::vector<double> Constants;
+        std::vector<uint32_t> CallArgs; // Argument nodes of every call.
+
+        uint32_t addNode(Opcode Op, uint32_t AVal, uint32_t BVal = 0,
+                         uint32_t CVal = 0);
+        uint32_t flatten(const ExprAST *E);
+
+    public:
+        /// assign - Re-encode this object from the tree rooted at Root, reusing
+        /// the storage of any previous expression.
+        void assign(const ExprAST *Root);
+
+        size_t size() const { return Ops.size(); }
+
+        /// appendKey - Append bytes that are equal for two expressions exactly
+        /// when their trees are.
+        void appendKey(std::string &Key) const;
+
+        /// collectCallees - Add the functions the expression calls, including
+        /// those behind user-defined operators, to Callees.
+        void collectCallees(SmallVectorImpl<SymbolID> &Callees) const;
+
+        Value *codegen() const;
     };
 
 } // end anonymous namespace
 
+uint32_t FlatExpr::addNode(Opcode Op, uint32_t AVal, uint32_t BVal,
+                           uint32_t CVal)
+{
+    Ops.push_back(Op);
+    A.push_back(AVal);
+    B.push_back(BVal);
+    C.push_back(CVal);
+    return Ops.size() - 1;
+}
+
+uint32_t FlatExpr::flatten(const ExprAST *E)
+{
+    switch (E->getKind())
+    {
+    case ExprAST::EK_Number:
+        Constants.push_back(cast<NumberExprAST>(E)->getVal());
+        return addNode(Const, Constants.size() - 1);
+    case ExprAST::EK_Variable:
+        return addNode(Var, cast<VariableExprAST>(E)->getName());
+    case ExprAST::EK_Binary:
+    {
+        auto *Bin = cast<BinaryExprAST>(E);
+        uint32_t L = flatten(Bin->getLHS());
+        uint32_t R = flatten(Bin->getRHS());
+        return addNode(BinOp, L, R, (unsigned char)Bin->getOp());
+    }
+    case ExprAST::EK_Call:
+    {
+        // Arguments may contain calls of their own, so collect our operands
+        // first and append them to CallArgs as one contiguous run.
+        auto *Call = cast<CallExprAST>(E);
+        SmallVector<uint32_t, 8> ArgNodes;
+        for (const ExprAST *Arg : Call->getArgs())
+            ArgNodes.push_back(flatten(Arg));
+        uint32_t First = CallArgs.size();
+        CallArgs.insert(CallArgs.end(), ArgNodes.begin(), ArgNodes.end());
+        return addNode(FlatExpr::Call, Call->getCallee(), First, ArgNodes.size());
+    }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+void FlatExpr::assign(const ExprAST *Root)
+{
+    Ops.clear();
+    A.clear();
+    B.clear();
+    C.clear();
+    Constants.clear();
+    CallArgs.clear();
+    flatten(Root);
+}
+
+void FlatExpr::appendKey(std::string &Key) const
+{
+    auto Append = [&Key](const auto &V)
+    { Key.append(reinterpret_cast<const char *>(V.data()), V.size() * sizeof(V[0])); };
+
+    // The counts make the concatenation unambiguous.
+    uint32_t Sizes[] = {uint32_t(Ops.size()), uint32_t(Constants.size()),
+                        uint32_t(CallArgs.size())};
+    Key.append(reinterpret_cast<const char *>(Sizes), sizeof(Sizes));
+    Append(Ops);
+    Append(A);
+    Append(B);
+    Append(C);
+    Append(Constants);
+    Append(CallArgs);
+}
+
 //===----------------------------------------------------------------------===//
 // Parser
 //===----------------------------------------------------------------------===//
@@ -215,9 +781,28 @@ namespace
 static int CurTok;
 static int getNextToken() { return CurTok = gettok(); }
 
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
+/// BinopInfo - What the parser and codegen need to know about a binary
+/// operator character.
+struct BinopInfo
+{
+    unsigned char Prec = 0; // 0 if the character is not a binary operator.
+    bool RightAssoc = false;
+    bool UserDefined = false;
+    SymbolID Fn = 0; // The "binaryX" function implementing a user operator.
+};
+
+/// BinopTable - Precedence and associativity for every character, indexed
+/// directly by the token value so lookups never search or allocate.
+static BinopInfo BinopTable[256];
+
+/// defineBinop - Install (or replace) a binary operator.  1 is the lowest
+/// precedence.
+static void defineBinop(unsigned char Op, unsigned Prec, bool RightAssoc = false,
+                        bool UserDefined = false, SymbolID Fn = 0)
+{
+    assert(Prec > 0 && Prec <= 255 && "invalid precedence");
+    BinopTable[Op] = {(unsigned char)Prec, RightAssoc, UserDefined, Fn};
+}
 
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
 static int GetTokPrecedence()
@@ -226,14 +811,14 @@ static int GetTokPrecedence()
         return -1;
 
     // Make sure it's a declared binop.
-    int TokPrec = BinopPrecedence[CurTok];
+    int TokPrec = BinopTable[CurTok].Prec;
     if (TokPrec <= 0)
         return -1;
     return TokPrec;
 }
 
 /// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str)
+ExprAST *LogError(const char *Str)
 {
     fprintf(stderr, "Error: %s\n", Str);
     return nullptr;
@@ -245,21 +830,21 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str)
     return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+static ExprAST *ParseExpression();
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr()
+static ExprAST *ParseNumberExpr()
 {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
+    auto *Result = newExpr<NumberExprAST>(NumVal);
     getNextToken(); // consume the number
-    return std::move(Result);
+    return Result;
 }
 
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr()
+static ExprAST *ParseParenExpr()
 {
     getNextToken(); // eat (.
-    auto V = ParseExpression();
+    auto *V = ParseExpression();
     if (!V)
         return nullptr;
 
@@ -272,24 +857,24 @@ static std::unique_ptr<ExprAST> ParseParenExpr()
 /// identifierexpr
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr()
+static ExprAST *ParseIdentifierExpr()
 {
-    std::string IdName = IdentifierStr;
+    SymbolID IdName = IdentifierSym;
 
     getNextToken(); // eat identifier.
 
     if (CurTok != '(') // Simple variable ref.
-        return std::make_unique<VariableExprAST>(IdName);
+        return newExpr<VariableExprAST>(IdName);
 
     // Call.
     getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    SmallVector<ExprAST *, 8> Args;
     if (CurTok != ')')
     {
         while (true)
         {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
+            if (auto *Arg = ParseExpression())
+                Args.push_back(Arg);
             else
                 return nullptr;
 
@@ -305,14 +890,14 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr()
     // Eat the ')'.
     getNextToken();
 
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    return newExpr<CallExprAST>(IdName, copyToArena(Args));
 }
 
 /// primary
 ///   ::= identifierexpr
 ///   ::= numberexpr
 ///   ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary()
+static ExprAST *ParsePrimary()
 {
     switch (CurTok)
     {
@@ -329,8 +914,7 @@ static std::unique_ptr<ExprAST> ParsePrimary()
 
 /// binoprhs
 ///   ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS)
+static ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS)
 {
     // If this is a binop, find its precedence.
     while (true)
@@ -347,85 +931,156 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
         getNextToken(); // eat binop
 
         // Parse the primary expression after the binary operator.
-        auto RHS = ParsePrimary();
+        auto *RHS = ParsePrimary();
         if (!RHS)
             return nullptr;
 
-        // If BinOp binds less tightly with RHS than the operator after RHS, let
-        // the pending operator take RHS as its LHS.
+        // If BinOp binds less tightly with RHS than the operator after RHS, or
+        // is right associative and binds equally tightly, let the pending
+        // operator take RHS as its LHS.
         int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec)
+        bool RightAssoc = BinopTable[BinOp].RightAssoc;
+        if (TokPrec < NextPrec || (RightAssoc && TokPrec == NextPrec))
         {
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+            RHS = ParseBinOpRHS(RightAssoc ? TokPrec : TokPrec + 1, RHS);
             if (!RHS)
                 return nullptr;
         }
 
         // Merge LHS/RHS.
-        LHS =
-            std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+        LHS = foldBinop(BinOp, LHS, RHS);
     }
 }
 
 /// expression
 ///   ::= primary binoprhs
 ///
-static std::unique_ptr<ExprAST> ParseExpression()
+static ExprAST *ParseExpression()
 {
-    auto LHS = ParsePrimary();
+    auto *LHS = ParsePrimary();
     if (!LHS)
         return nullptr;
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
 }
 
 /// prototype
 ///   ::= id '(' id* ')'
+///   ::= binary LETTER number? ('left' | 'right')? (id, id)
 static std::unique_ptr<PrototypeAST> ParsePrototype()
 {
-    if (CurTok != tok_identifier)
+    SymbolID FnName;
+    bool IsOperator = false;
+    unsigned BinaryPrecedence = 30;
+    bool RightAssoc = false;
+
+    switch (CurTok)
+    {
+    default:
         return LogErrorP("Expected function name in prototype");
+    case tok_identifier:
+        FnName = IdentifierSym;
+        getNextToken();
+        break;
+    case tok_binary:
+    {
+        getNextToken();
+        if (!isascii(CurTok) || isalnum(CurTok) || strchr("(),;#.", CurTok))
+            return LogErrorP("Expected binary operator");
+        if (BinopTable[CurTok].Prec && !BinopTable[CurTok].UserDefined)
+            return LogErrorP("Cannot redefine a builtin binary operator");
+        char OpName[] = {'b', 'i', 'n', 'a', 'r', 'y', (char)CurTok};
+        FnName = Symbols.intern(StringRef(OpName, sizeof(OpName)));
+        IsOperator = true;
+        getNextToken();
 
-    std::string FnName = IdentifierStr;
-    getNextToken();
+        // Read the precedence if present.
+        if (CurTok == tok_number)
+        {
+            if (NumVal < 1 || NumVal > 100)
+                return LogErrorP("Invalid precedence: must be 1..100");
+            BinaryPrecedence = (unsigned)NumVal;
+            getNextToken();
+        }
+
+        // Read the associativity if present.
+        if (CurTok == tok_identifier &&
+            (IdentifierSym == sym_left || IdentifierSym == sym_right))
+        {
+            RightAssoc = IdentifierSym == sym_right;
+            getNextToken();
+        }
+        break;
+    }
+    }
 
     if (CurTok != '(')
         return LogErrorP("Expected '(' in prototype");
 
-    std::vector<std::string> ArgNames;
+    std::vector<SymbolID> ArgNames;
     while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
+        ArgNames.push_back(IdentifierSym);
     if (CurTok != ')')
         return LogErrorP("Expected ')' in prototype");
 
     // success.
     getNextToken(); // eat ')'.
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+    // Verify right number of names for operator.
+    if (IsOperator && ArgNames.size() != 2)
+        return LogErrorP("Invalid number of operands for operator");
+
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), IsOperator,
+                                          BinaryPrecedence, RightAssoc);
 }
 
-/// definition ::= 'def' prototype expression
+/// definition ::= 'export'? 'def' prototype expression
+///
+/// 'export' matters only to drivers that see the whole program in one module,
+/// which keep unexported definitions private.
 static std::unique_ptr<FunctionAST> ParseDefinition()
 {
+    bool Exported = CurTok == tok_export;
+    if (Exported)
+    {
+        getNextToken(); // eat export.
+        if (CurTok != tok_def)
+        {
+            LogError("Expected 'def' after 'export'");
+            return nullptr;
+        }
+    }
     getNextToken(); // eat def.
     auto Proto = ParsePrototype();
     if (!Proto)
         return nullptr;
 
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    if (auto *E = ParseExpression())
+    {
+        // Install a user-defined operator right away, so the rest of the input
+        // parses with it whether or not we codegen in between.
+        if (Proto->isBinaryOp())
+            defineBinop(Proto->getOperatorName(), Proto->getBinaryPrecedence(),
+                        Proto->isRightAssoc(), /*UserDefined=*/true,
+                        Proto->getName());
+        auto FnAST = std::make_unique<FunctionAST>(std::move(Proto), E, FloatMode);
+        if (Exported)
+            FnAST->setExported();
+        return FnAST;
+    }
     return nullptr;
 }
 
 /// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
+static std::unique_ptr<FunctionAST>
+ParseTopLevelExpr(SymbolID Name = sym_anon_expr)
 {
-    if (auto E = ParseExpression())
+    if (auto *E = ParseExpression())
     {
         // Make an anonymous proto.
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-                                                    std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        auto Proto =
+            std::make_unique<PrototypeAST>(Name, std::vector<SymbolID>());
+        return std::make_unique<FunctionAST>(std::move(Proto), E, FloatMode);
     }
     return nullptr;
 }
@@ -434,65 +1089,598 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
 static std::unique_ptr<PrototypeAST> ParseExtern()
 {
     getNextToken(); // eat extern.
-    return ParsePrototype();
+    auto Proto = ParsePrototype();
+    if (Proto)
+        Proto->setExtern();
+    return Proto;
 }
 
 //===----------------------------------------------------------------------===//
-// Code Generation
+// Stage Timing
 //===----------------------------------------------------------------------===//
 
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::map<std::string, Value *> NamedValues;
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-static ExitOnError ExitOnErr;
-
-Value *LogErrorV(const char *Str)
+/// Stage - A step every top-level item may go through on its way to a value.
+/// Parsing includes lexing, which is timed per item rather than per token to
+/// keep the lexer's inner loop free of clock reads.
+enum Stage
 {
-    LogError(Str);
-    return nullptr;
-}
+    StageParse,
+    StageCodegen,
+    StageImport,
+    StageOptimize,
+    StageRetain,
+    StageAdd,
+    StageLookup,
+    StageRun,
+    StageInterpret,
+    NumStages
+};
 
-Function *getFunction(std::string Name)
-{
-    // First, see if the function has already been added to the current module.
-    if (auto *F = TheModule->getFunction(Name))
-        return F;
+static const char *const StageNames[NumStages] = {
+    "parse", "codegen", "import", "optimize", "retain",
+    "add",   "lookup",  "run",    "interpret"};
 
-    // If not, check whether we can codegen the declaration from some existing
-    // prototype.
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+/// LatencyHistogram - Log-linear buckets of nanosecond latencies: four per
+/// power of two, so percentiles are within 25% of the true value.
+class LatencyHistogram
+{
+    static constexpr unsigned NumBuckets = 64 * 4;
+    uint64_t Buckets[NumBuckets] = {};
+    uint64_t Count = 0;
+    uint64_t TotalNs = 0;
+    uint64_t MaxNs = 0;
 
-    // If no existing prototype exists, return null.
-    return nullptr;
-}
+    static unsigned getBucket(uint64_t Ns)
+    {
+        if (Ns < 8)
+            return Ns;
+        unsigned E = Log2_64(Ns);
+        return E * 4 + ((Ns >> (E - 2)) & 3);
+    }
 
-Value *NumberExprAST::codegen()
-{
-    return ConstantFP::get(*TheContext, APFloat(Val));
-}
+    /// getBucketLimit - The largest latency in bucket B.
+    static uint64_t getBucketLimit(unsigned B)
+    {
+        if (B < 8)
+            return B;
+        unsigned E = B / 4;
+        return ((uint64_t(4 + B % 4 + 1)) << (E - 2)) - 1;
+    }
+
+public:
+    void record(uint64_t Ns)
+    {
+        ++Buckets[getBucket(Ns)];
+        ++Count;
+        TotalNs += Ns;
+        MaxNs = std::max(MaxNs, Ns);
+    }
+
+    uint64_t getCount() const { return Count; }
+    uint64_t getTotalNs() const { return TotalNs; }
+    uint64_t getMaxNs() const { return MaxNs; }
+
+    /// getPercentileNs - An upper bound on the latency P of the samples
+    /// (0 < P <= 1) are within.
+    uint64_t getPercentileNs(double P) const
+    {
+        uint64_t Rank = std::max<uint64_t>(1, uint64_t(P * Count + 0.5));
+        uint64_t Seen = 0;
+        for (unsigned B = 0; B != NumBuckets; ++B)
+            if ((Seen += Buckets[B]) >= Rank)
+                return std::min(getBucketLimit(B), MaxNs);
+        return MaxNs;
+    }
+};
+
+/// StageTimes/PassSeconds - Everything timed so far.  PassSeconds has the
+/// exclusive time of each pass and analysis, by the definition it ran on.
+/// Optimization may run on the compile threads, so both are guarded.
+static LatencyHistogram StageTimes[NumStages];
+static StringMap<StringMap<double>> PassSeconds;
+static std::mutex TimingMutex;
+
+static void recordStage(Stage S, std::chrono::steady_clock::duration D)
+{
+    auto Ns = std::chrono::duration_cast<std::chrono::nanoseconds>(D).count();
+    std::lock_guard<std::mutex> Lock(TimingMutex);
+    StageTimes[S].record(Ns);
+}
+
+/// StageTimer - Charges the time until it goes out of scope to a stage.
+class StageTimer
+{
+    Stage S;
+    std::chrono::steady_clock::time_point Start;
+
+public:
+    explicit StageTimer(Stage S) : S(S), Start(std::chrono::steady_clock::now()) {}
+    ~StageTimer() { recordStage(S, std::chrono::steady_clock::now() - Start); }
+};
+
+/// timeStage - Call Fn, charging the time it takes to stage S.
+template <typename FnT>
+static auto timeStage(Stage S, FnT Fn) -> decltype(Fn())
+{
+    StageTimer T(S);
+    return Fn();
+}
+
+/// PassClock - Collects the exclusive time of each pass and analysis over
+/// one optimizer run.  Function and loop passes are charged to the function
+/// they ran on, and everything else, along with work on bodies imported only
+/// for inlining, to the module's Label.
+class PassClock
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Running
+    {
+        std::string Unit;
+        StringRef Pass;
+        Clock::time_point Start;
+    };
+
+    std::string Label;
+    SmallVector<Running, 8> Stack;
+    StringMap<StringMap<double>> Seconds;
+
+    /// isSkipped - Pass managers and adaptors only run other passes.
+    static bool isSkipped(StringRef PassID)
+    {
+        return PassID.contains("PassManager") || PassID.contains("PassAdaptor");
+    }
+
+    std::string getUnit(Any IR) const
+    {
+        const Function *F = nullptr;
+        if (any_isa<const Function *>(IR))
+            F = any_cast<const Function *>(IR);
+        else if (any_isa<const Loop *>(IR))
+            F = any_cast<const Loop *>(IR)->getHeader()->getParent();
+        if (!F || F->hasAvailableExternallyLinkage())
+            return Label;
+        return F->getName().str();
+    }
+
+    /// charge - Add the time since Top last started to its pass.
+    void charge(Running &Top, Clock::time_point Now)
+    {
+        std::chrono::duration<double> D = Now - Top.Start;
+        Seconds[Top.Unit][Top.Pass] += D.count();
+    }
+
+    void start(StringRef PassID, Any IR)
+    {
+        if (isSkipped(PassID))
+            return;
+        auto Now = Clock::now();
+        if (!Stack.empty())
+            charge(Stack.back(), Now);
+        Stack.push_back({getUnit(IR), PassID, Now});
+    }
+
+    void stop(StringRef PassID)
+    {
+        if (isSkipped(PassID) || Stack.empty())
+            return;
+        auto Now = Clock::now();
+        charge(Stack.back(), Now);
+        Stack.pop_back();
+        if (!Stack.empty())
+            Stack.back().Start = Now;
+    }
+
+public:
+    PassClock(PassInstrumentationCallbacks &PIC, const Module &M)
+    {
+        // A JIT module defines one function, so name it after that.
+        for (const Function &F : M)
+            if (!F.isDeclaration() && !F.hasAvailableExternallyLinkage())
+            {
+                if (!Label.empty())
+                {
+                    Label = "(module)";
+                    break;
+                }
+                Label = F.getName().str();
+            }
+
+        PIC.registerBeforeNonSkippedPassCallback(
+            [this](StringRef P, Any IR) { start(P, IR); });
+        PIC.registerAfterPassCallback(
+            [this](StringRef P, Any, const PreservedAnalyses &) { stop(P); });
+        PIC.registerAfterPassInvalidatedCallback(
+            [this](StringRef P, const PreservedAnalyses &) { stop(P); });
+        PIC.registerBeforeAnalysisCallback(
+            [this](StringRef P, Any IR) { start(P, IR); });
+        PIC.registerAfterAnalysisCallback([this](StringRef P, Any) { stop(P); });
+    }
+
+    /// fold - Add this run's times to PassSeconds.
+    void fold()
+    {
+        std::lock_guard<std::mutex> Lock(TimingMutex);
+        for (auto &Unit : Seconds)
+            for (auto &Pass : Unit.second)
+                PassSeconds[Unit.first()][Pass.first()] += Pass.second;
+    }
+};
+
+/// printStageTimes - The :stats report.
+static void printStageTimes()
+{
+    std::lock_guard<std::mutex> Lock(TimingMutex);
+    fprintf(stderr, "%-10s %8s %12s %10s %10s %10s\n", "stage", "count",
+            "total ms", "p50 us", "p99 us", "max us");
+    for (unsigned S = 0; S != NumStages; ++S)
+    {
+        const LatencyHistogram &H = StageTimes[S];
+        if (!H.getCount())
+            continue;
+        fprintf(stderr, "%-10s %8llu %12.3f %10.1f %10.1f %10.1f\n",
+                StageNames[S], (unsigned long long)H.getCount(),
+                H.getTotalNs() / 1e6, H.getPercentileNs(0.5) / 1e3,
+                H.getPercentileNs(0.99) / 1e3, H.getMaxNs() / 1e3);
+    }
+}
+
+static cl::opt<bool> PassTiming(
+    "pass-timing",
+    cl::desc("Time each pass on each definition, for :passes and -timing-json"));
+
+/// printPassTimes - The :passes report: Name's passes, slowest first.
+static void printPassTimes(StringRef Name)
+{
+    std::lock_guard<std::mutex> Lock(TimingMutex);
+    auto DI = PassSeconds.find(Name);
+    if (DI == PassSeconds.end())
+    {
+        fprintf(stderr, "No pass timings for %s%s\n", Name.str().c_str(),
+                PassTiming ? "" : " (they are kept with -pass-timing)");
+        return;
+    }
+
+    std::vector<std::pair<double, StringRef>> Passes;
+    double Total = 0;
+    for (auto &Pass : DI->second)
+    {
+        Passes.push_back({Pass.second, Pass.first()});
+        Total += Pass.second;
+    }
+    llvm::sort(Passes, [](const auto &A, const auto &B) { return A.first > B.first; });
+    fprintf(stderr, "Passes on %s: %.3f ms\n", Name.str().c_str(), Total * 1e3);
+    for (auto &Pass : Passes)
+        fprintf(stderr, "  %10.3f ms  %s\n", Pass.first * 1e3, Pass.second.str().c_str());
+}
+
+static cl::opt<std::string> TimingJSON(
+    "timing-json",
+    cl::desc("Write stage latencies and per-definition pass times to this "
+             "file as JSON at exit ('-' for stdout)"),
+    cl::value_desc("filename"));
+
+/// isTimingPasses - Whether anything will report pass times.  Timing every
+/// pass costs two clock reads per pass and function, so it is off otherwise.
+static bool isTimingPasses() { return PassTiming || !TimingJSON.empty(); }
+
+/// writeTimingJSON - Dump everything timed to TimingJSON.
+static Error writeTimingJSON()
+{
+    std::error_code EC;
+    raw_fd_ostream OS(TimingJSON, EC, sys::fs::OF_TextWithCRLF);
+    if (EC)
+        return createFileError(TimingJSON, EC);
+
+    std::lock_guard<std::mutex> Lock(TimingMutex);
+    json::OStream J(OS, 2);
+    J.object(
+        [&]
+        {
+            J.attributeObject(
+                "stages",
+                [&]
+                {
+                    for (unsigned S = 0; S != NumStages; ++S)
+                    {
+                        const LatencyHistogram &H = StageTimes[S];
+                        J.attributeObject(
+                            StageNames[S],
+                            [&]
+                            {
+                                J.attribute("count", int64_t(H.getCount()));
+                                J.attribute("total_ns", int64_t(H.getTotalNs()));
+                                J.attribute("p50_ns", int64_t(H.getPercentileNs(0.5)));
+                                J.attribute("p99_ns", int64_t(H.getPercentileNs(0.99)));
+                                J.attribute("max_ns", int64_t(H.getMaxNs()));
+                            });
+                    }
+                });
+            J.attributeObject(
+                "passes",
+                [&]
+                {
+                    for (auto &Def : PassSeconds)
+                        J.attributeObject(
+                            Def.first(),
+                            [&]
+                            {
+                                for (auto &Pass : Def.second)
+                                    J.attribute(Pass.first(), Pass.second);
+                            });
+                });
+        });
+    OS << "\n";
+    return Error::success();
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation
+//===----------------------------------------------------------------------===//
+
+static std::unique_ptr<LLVMContext> TheContext;
+static std::unique_ptr<Module> TheModule;
+static std::unique_ptr<IRBuilder<>> Builder;
+static DenseMap<SymbolID, Value *> NamedValues;
+static std::unique_ptr<KaleidoscopeJIT> TheJIT;
+static DenseMap<SymbolID, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static ExitOnError ExitOnErr;
+
+static cl::opt<unsigned> CompileThreads(
+    "compile-threads",
+    cl::desc("Optimize and compile modules on this many background threads "
+             "(0 compiles on the REPL thread)"),
+    cl::init(0));
+
+static cl::opt<bool> LazyCompile(
+    "lazy", cl::desc("Optimize and compile each definition on its first call"));
+
+static cl::opt<bool> HotSwap(
+    "hot-swap",
+    cl::desc("Call definitions through stubs, so that redefining one compiles "
+             "just its new body"));
+
+static cl::opt<std::string> ObjectCacheDir(
+    "object-cache",
+    cl::desc("Keep compiled objects in this directory and reuse them in later "
+             "runs instead of optimizing and compiling again"),
+    cl::value_desc("dir"));
+
+static cl::opt<bool> JITDebugger(
+    "jit-debugger", cl::desc("Register JIT'd code with GDB's JIT interface"));
+
+static cl::opt<bool> PerfMap(
+    "perf-map",
+    cl::desc("Name JIT'd functions for perf in /tmp/perf-<pid>.map"));
+
+static cl::opt<bool> PerfJITDump(
+    "perf-jitdump",
+    cl::desc("Record JIT'd code in a jitdump file for 'perf inject --jit'"));
+
+/// deferOptimization - Whether modules are optimized by the JIT as they are
+/// compiled, rather than on the REPL thread before they are added.
+/// The object cache needs the IR before optimization to key on.
+static bool deferOptimization()
+{
+    return CompileThreads > 0 || LazyCompile || !ObjectCacheDir.empty();
+}
+
+/// addDefinitionModule - Hand a module of definitions to the JIT, behind lazy
+/// stubs if requested.
+static void addDefinitionModule(ThreadSafeModule TSM,
+                                ResourceTrackerSP RT = nullptr)
+{
+    StageTimer Timer(StageAdd);
+    if (LazyCompile)
+        ExitOnErr(TheJIT->addLazyModule(std::move(TSM), RT));
+    else
+        ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
+}
+
+Value *LogErrorV(const char *Str)
+{
+    LogError(Str);
+    return nullptr;
+}
+
+Function *getFunction(SymbolID Name)
+{
+    // First, see if the function has already been added to the current module.
+    if (auto *F = TheModule->getFunction(Symbols.getName(Name)))
+        return F;
+
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype.
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen();
+
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+static cl::opt<bool> MathIntrinsics(
+    "math-intrinsics",
+    cl::desc("Call LLVM intrinsics for externs of the libm functions the "
+             "optimizer knows"),
+    cl::init(true));
+
+/// MathBuiltin - A libm function with an LLVM intrinsic of the same meaning.
+/// The optimizer folds, hoists and vectorizes intrinsics, while a call to an
+/// opaque extern has to stay put.
+struct MathBuiltin
+{
+    const char *Name;
+    unsigned NumArgs;
+    Intrinsic::ID ID;
+};
+
+static const MathBuiltin MathBuiltins[] = {
+    {"sin", 1, Intrinsic::sin},           {"cos", 1, Intrinsic::cos},
+    {"exp", 1, Intrinsic::exp},           {"exp2", 1, Intrinsic::exp2},
+    {"log", 1, Intrinsic::log},           {"log2", 1, Intrinsic::log2},
+    {"log10", 1, Intrinsic::log10},       {"sqrt", 1, Intrinsic::sqrt},
+    {"fabs", 1, Intrinsic::fabs},         {"floor", 1, Intrinsic::floor},
+    {"ceil", 1, Intrinsic::ceil},         {"trunc", 1, Intrinsic::trunc},
+    {"round", 1, Intrinsic::round},       {"rint", 1, Intrinsic::rint},
+    {"nearbyint", 1, Intrinsic::nearbyint},
+    {"pow", 2, Intrinsic::pow},           {"copysign", 2, Intrinsic::copysign},
+    {"fmin", 2, Intrinsic::minnum},       {"fmax", 2, Intrinsic::maxnum},
+    {"fma", 3, Intrinsic::fma},
+};
+
+/// findMathBuiltin - The math builtin P declares, if it is an extern of one
+/// with the builtin's arity.
+static const MathBuiltin *findMathBuiltin(const PrototypeAST &P)
+{
+    if (!P.isExtern())
+        return nullptr;
+    StringRef Name = Symbols.getName(P.getName());
+    for (const MathBuiltin &B : MathBuiltins)
+        if (Name == B.Name && P.getArgs().size() == B.NumArgs)
+            return &B;
+    return nullptr;
+}
+
+/// getCalledFunction - The function a call to Name invokes: the intrinsic if
+/// Name is an extern of a math builtin, otherwise getFunction's.  A definition
+/// replaces the extern prototype, so a user's own 'def sin(x)' is called as
+/// written.
+static Function *getCalledFunction(SymbolID Name)
+{
+    auto PI = FunctionProtos.find(Name);
+    if (MathIntrinsics && PI != FunctionProtos.end())
+        if (const MathBuiltin *B = findMathBuiltin(*PI->second))
+            return Intrinsic::getDeclaration(TheModule.get(), B->ID,
+                                             {Builder->getDoubleTy()});
+    return getFunction(Name);
+}
+
+/// getCalleeEffects - The effects of calling P's function.  Math builtins
+/// are pure whether or not they are called as intrinsics: Kaleidoscope code
+/// cannot observe errno.  A hot-swapped definition may gain effects after
+/// its callers are compiled, so they assume it has them all.
+static Effects getCalleeEffects(const PrototypeAST &P)
+{
+    if (P.isExtern())
+        return findMathBuiltin(P) ? Pure : MayHaveSideEffects;
+    if (HotSwap)
+        return MayHaveSideEffects;
+    return P.getEffects();
+}
+
+/// inferEffects - Set the effects of a definition from those of its body,
+/// which can only do arithmetic and make calls.  Callees must already have
+/// prototypes, so the only cycle possible is a direct recursive call.
+static void inferEffects(PrototypeAST &P, const ExprAST *Body)
+{
+    static FlatExpr Flat;
+    Flat.assign(Body);
+    SmallVector<SymbolID, 8> Callees;
+    Flat.collectCallees(Callees);
+
+    Effects E = Pure;
+    for (SymbolID Callee : Callees)
+    {
+        if (Callee == P.getName())
+        {
+            E = std::min(E, PureMayNotReturn);
+            continue;
+        }
+        auto PI = FunctionProtos.find(Callee);
+        E = std::min(E, PI == FunctionProtos.end()
+                            ? MayHaveSideEffects
+                            : getCalleeEffects(*PI->second));
+    }
+    P.setEffects(E);
+}
+
+/// addEffectAttributes - Tell LLVM what F cannot do, so it can merge, hoist
+/// and vectorize calls to it.
+static void addEffectAttributes(Function &F, Effects E)
+{
+    if (E == MayHaveSideEffects)
+        return;
+    F.setDoesNotAccessMemory();
+    F.setDoesNotThrow();
+    F.addFnAttr(Attribute::NoSync);
+    F.addFnAttr(Attribute::NoFree);
+    if (E == Pure)
+        F.addFnAttr(Attribute::WillReturn);
+}
+
+Value *NumberExprAST::codegen()
+{
+    return ConstantFP::get(*TheContext, APFloat(Val));
+}
 
 Value *VariableExprAST::codegen()
 {
     // Look this variable up in the function.
-    Value *V = NamedValues[Name];
+    Value *V = NamedValues.lookup(Name);
     if (!V)
         return LogErrorV("Unknown variable name");
     return V;
 }
 
-Value *BinaryExprAST::codegen()
+/// getFastMathFlags - The flags every operation of a function in mode FP
+/// carries.
+static FastMathFlags getFastMathFlags(FPMode FP)
 {
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
-    if (!L || !R)
+    FastMathFlags FMF;
+    if (FP == FPFast)
+        FMF.setFast();
+    else if (FP == FPContract)
+        FMF.setAllowContract();
+    return FMF;
+}
+
+/// emitMulAdd - When contraction is allowed, fold an fmul just generated for
+/// an operand of '+' or '-' into llvm.fmuladd, which the backend turns into
+/// an FMA wherever the target has one.  Every operand value has a single use,
+/// its parent node, so a fresh fmul without uses yet is ours to replace.
+/// Returns null if neither side is such an fmul.
+static Value *emitMulAdd(char Op, Value *L, Value *R)
+{
+    auto IsFreshMul = [](Value *V)
+    {
+        auto *I = dyn_cast<Instruction>(V);
+        return I && I->getOpcode() == Instruction::FMul && I->use_empty();
+    };
+
+    Instruction *Mul;
+    Value *Addend;
+    bool NegateProduct = false;
+    if (IsFreshMul(L))
+    {
+        Mul = cast<Instruction>(L);
+        Addend = Op == '-' ? Builder->CreateFNeg(R, "negtmp") : R;
+    }
+    else if (IsFreshMul(R))
+    {
+        Mul = cast<Instruction>(R);
+        Addend = L;
+        NegateProduct = Op == '-';
+    }
+    else
         return nullptr;
 
+    Value *A = Mul->getOperand(0), *B = Mul->getOperand(1);
+    Mul->eraseFromParent();
+    if (NegateProduct)
+        A = Builder->CreateFNeg(A, "negtmp");
+    return Builder->CreateIntrinsic(Intrinsic::fmuladd, {A->getType()},
+                                    {A, B, Addend}, nullptr, "fmatmp");
+}
+
+/// emitBinOp - Emit the instructions for a builtin or user-defined binary
+/// operator.
+static Value *emitBinOp(char Op, Value *L, Value *R)
+{
+    if ((Op == '+' || Op == '-') && Builder->getFastMathFlags().allowContract())
+        if (Value *V = emitMulAdd(Op, L, R))
+            return V;
+
     switch (Op)
     {
     case '+':
@@ -506,14 +1694,36 @@ Value *BinaryExprAST::codegen()
         // Convert bool 0/1 to double 0.0 or 1.0
         return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
     default:
-        return LogErrorV("invalid binary operator");
+        break;
     }
+
+    // If it wasn't a builtin binary operator, it must be a user defined one.
+    // Emit a call to it.
+    const BinopInfo &Info = BinopTable[(unsigned char)Op];
+    if (!Info.UserDefined)
+        return LogErrorV("invalid binary operator");
+    Function *F = getFunction(Info.Fn);
+    if (!F)
+        return LogErrorV("binary operator not found!");
+
+    Value *Ops[] = {L, R};
+    return Builder->CreateCall(F, Ops, "binop");
+}
+
+Value *BinaryExprAST::codegen()
+{
+    Value *L = LHS->codegen();
+    Value *R = RHS->codegen();
+    if (!L || !R)
+        return nullptr;
+
+    return emitBinOp(Op, L, R);
 }
 
 Value *CallExprAST::codegen()
 {
     // Look up the name in the global module table.
-    Function *CalleeF = getFunction(Callee);
+    Function *CalleeF = getCalledFunction(Callee);
     if (!CalleeF)
         return LogErrorV("Unknown function referenced");
 
@@ -532,6 +1742,59 @@ Value *CallExprAST::codegen()
     return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
+Value *FlatExpr::codegen() const
+{
+    // Operands always precede their users, so a single forward pass sees
+    // every operand's value before it is needed.
+    SmallVector<Value *, 64> Values(Ops.size());
+    SmallVector<Value *, 8> ArgsV;
+    for (size_t I = 0, E = Ops.size(); I != E; ++I)
+    {
+        switch (Ops[I])
+        {
+        case Const:
+            Values[I] = ConstantFP::get(*TheContext, APFloat(Constants[A[I]]));
+            break;
+        case Var:
+            Values[I] = NamedValues.lookup(A[I]);
+            if (!Values[I])
+                return LogErrorV("Unknown variable name");
+            break;
+        case BinOp:
+            Values[I] = emitBinOp(C[I], Values[A[I]], Values[B[I]]);
+            if (!Values[I])
+                return nullptr;
+            break;
+        case Call:
+        {
+            Function *CalleeF = getCalledFunction(A[I]);
+            if (!CalleeF)
+                return LogErrorV("Unknown function referenced");
+            if (CalleeF->arg_size() != C[I])
+                return LogErrorV("Incorrect # arguments passed");
+
+            ArgsV.clear();
+            for (uint32_t Arg = B[I], End = B[I] + C[I]; Arg != End; ++Arg)
+                ArgsV.push_back(Values[CallArgs[Arg]]);
+            Values[I] = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+            break;
+        }
+        }
+    }
+    return Values.back();
+}
+
+void FlatExpr::collectCallees(SmallVectorImpl<SymbolID> &Callees) const
+{
+    for (size_t I = 0, E = Ops.size(); I != E; ++I)
+    {
+        if (Ops[I] == Call)
+            Callees.push_back(A[I]);
+        else if (Ops[I] == BinOp && BinopTable[C[I]].UserDefined)
+            Callees.push_back(BinopTable[C[I]].Fn);
+    }
+}
+
 Function *PrototypeAST::codegen()
 {
     // Make the function type:  double(double,double) etc.
@@ -539,37 +1802,60 @@ Function *PrototypeAST::codegen()
     FunctionType *FT =
         FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
 
-    Function *F =
-        Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+    Function *F = Function::Create(FT, Function::ExternalLinkage,
+                                   Symbols.getName(Name), TheModule.get());
 
     // Set names for all arguments.
     unsigned Idx = 0;
     for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
+        Arg.setName(Symbols.getName(Args[Idx++]));
 
+    addEffectAttributes(*F, getCalleeEffects(*this));
     return F;
 }
 
+static cl::opt<bool>
+    FlatCodegen("flat-codegen",
+                cl::desc("Generate function bodies from the flat expression form"));
+
 Function *FunctionAST::codegen()
 {
     // Transfer ownership of the prototype to the FunctionProtos map, but keep a
     // reference to it for use below.
     auto &P = *Proto;
+    inferEffects(P, Body);
     FunctionProtos[Proto->getName()] = std::move(Proto);
     Function *TheFunction = getFunction(P.getName());
     if (!TheFunction)
         return nullptr;
 
+    if (!TheFunction->empty())
+        return (Function *)LogErrorV("Function cannot be redefined.");
+    // The module may already declare it, for an extern of the same name.
+    TheFunction->setAttributes(AttributeList());
+    addEffectAttributes(*TheFunction, P.getEffects());
+
     // Create a new basic block to start insertion into.
     BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
     Builder->SetInsertPoint(BB);
+    Builder->setFastMathFlags(getFastMathFlags(FP));
 
     // Record the function arguments in the NamedValues map.
     NamedValues.clear();
-    for (auto &Arg : TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
+    for (auto ArgAndName : zip(TheFunction->args(), P.getArgs()))
+        NamedValues[std::get<1>(ArgAndName)] = &std::get<0>(ArgAndName);
 
-    if (Value *RetVal = Body->codegen())
+    Value *RetVal;
+    if (FlatCodegen)
+    {
+        static FlatExpr Flat;
+        Flat.assign(Body);
+        RetVal = Flat.codegen();
+    }
+    else
+        RetVal = Body->codegen();
+
+    if (RetVal)
     {
         // Finish off the function.
         Builder->CreateRet(RetVal);
@@ -577,9 +1863,6 @@ Function *FunctionAST::codegen()
         // Validate the generated code, checking for consistency.
         verifyFunction(*TheFunction);
 
-        // Run the optimizer on the function.
-        TheFPM->run(*TheFunction);
-
         return TheFunction;
     }
 
@@ -589,110 +1872,1534 @@ Function *FunctionAST::codegen()
 }
 
 //===----------------------------------------------------------------------===//
-// Top-Level parsing and JIT Driver
+// Optimizer
 //===----------------------------------------------------------------------===//
 
-static void InitializeModuleAndPassManager()
+static cl::opt<unsigned> OptLevel(
+    "O",
+    cl::desc("Optimization level: 0 = none, 1 = inline and clean up (the "
+             "default), 2/3 = the full pipeline with vectorization"),
+    cl::Prefix, cl::init(1));
+
+/// OptLevelFlag - Module flag recording the level a module's definitions were
+/// generated at, so that compile threads use it even after :opt changed the
+/// session's level.
+static constexpr const char *OptLevelFlag = "kaleidoscope.opt-level";
+
+/// O1Pipeline - The four cleanup passes, after inlining whatever the module
+/// can see.  In the REPL that is nothing, but batch and AOT modules hold many
+/// definitions.
+static constexpr const char *O1Pipeline =
+    "cgscc(inline),function(instcombine,reassociate,gvn,simplifycfg)";
+
+/// setModuleOptLevel - Record the level M's definitions should be optimized at.
+static void setModuleOptLevel(Module &M, unsigned Level)
 {
-    // Open a new context and module.
-    TheContext = std::make_unique<LLVMContext>();
-    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
-    TheModule->setDataLayout(TheJIT->getDataLayout());
+    M.setModuleFlag(Module::Warning, OptLevelFlag,
+                    ConstantAsMetadata::get(ConstantInt::get(
+                        Type::getInt32Ty(M.getContext()), Level)));
+}
 
-    // Create a new builder for the module.
-    Builder = std::make_unique<IRBuilder<>>(*TheContext);
+static unsigned getModuleOptLevel(const Module &M)
+{
+    if (auto *Level =
+            mdconst::extract_or_null<ConstantInt>(M.getModuleFlag(OptLevelFlag)))
+        return Level->getZExtValue();
+    return OptLevel;
+}
 
-    // Create a new pass manager attached to it.
-    TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+static cl::opt<TargetLibraryInfoImpl::VectorLibrary> VectorMath(
+    "vector-math",
+    cl::desc("Vector math library for vectorized calls to math builtins"),
+    cl::init(TargetLibraryInfoImpl::NoLibrary),
+    cl::values(clEnumValN(TargetLibraryInfoImpl::NoLibrary, "none",
+                          "Keep math builtins scalar"),
+               clEnumValN(TargetLibraryInfoImpl::LIBMVEC_X86, "libmvec",
+                          "glibc's libmvec (x86-64)"),
+               clEnumValN(TargetLibraryInfoImpl::SVML, "svml",
+                          "Intel's Short Vector Math Library")));
+
+/// loadVectorMathLibrary - Make the library -vector-math names resolvable by
+/// the JIT, which finds it in the process like libm.  AOT objects link
+/// against it instead.
+static Error loadVectorMathLibrary()
+{
+    const char *Lib = nullptr;
+    switch (VectorMath)
+    {
+    case TargetLibraryInfoImpl::LIBMVEC_X86:
+        Lib = "libmvec.so.1";
+        break;
+    case TargetLibraryInfoImpl::SVML:
+        Lib = "libsvml.so";
+        break;
+    default:
+        return Error::success();
+    }
 
-    // Do simple "peephole" optimizations and bit-twiddling optzns.
-    TheFPM->add(createInstructionCombiningPass());
-    // Reassociate expressions.
-    TheFPM->add(createReassociatePass());
-    // Eliminate Common SubExpressions.
-    TheFPM->add(createGVNPass());
-    // Simplify the control flow graph (deleting unreachable blocks, etc).
-    TheFPM->add(createCFGSimplificationPass());
+    std::string ErrMsg;
+    if (sys::DynamicLibrary::LoadLibraryPermanently(Lib, &ErrMsg))
+        return createStringError(inconvertibleErrorCode(), "cannot load %s: %s",
+                                 Lib, ErrMsg.c_str());
+    return Error::success();
+}
 
-    TheFPM->doInitialization();
+/// getTargetMachine - The target for the vectorizers' cost models to see M
+/// run on: the host for the JIT, and whatever an AOT module was given.  Kept
+/// per thread, as modules are optimized on the compile threads too, and
+/// rebuilt only when the triple changes.
+static Expected<TargetMachine *> getTargetMachine(const Module &M)
+{
+    static thread_local std::unique_ptr<TargetMachine> TM;
+    static thread_local std::string TMTriple;
+    if (TM && TMTriple == M.getTargetTriple())
+        return TM.get();
+
+    auto JTMB = M.getTargetTriple().empty()
+                    ? JITTargetMachineBuilder::detectHost()
+                    : JITTargetMachineBuilder(Triple(M.getTargetTriple()));
+    if (!JTMB)
+        return JTMB.takeError();
+    auto NewTM = JTMB->createTargetMachine();
+    if (!NewTM)
+        return NewTM.takeError();
+    TM = std::move(*NewTM);
+    TMTriple = M.getTargetTriple();
+    return TM.get();
 }
 
-static void HandleDefinition()
+/// OptimizeModule - Run the new pass manager pipeline for M's level over it.
+/// Handed to the JIT when optimization is deferred to the compile threads,
+/// where it runs concurrently on modules in separate contexts, so it only
+/// touches M, read-only options and per-thread state.
+static Error OptimizeModule(Module &M)
 {
-    if (auto FnAST = ParseDefinition())
+    unsigned Level = getModuleOptLevel(M);
+    if (Level == 0)
+        return Error::success();
+    StageTimer Timer(StageOptimize);
+
+    auto TM = getTargetMachine(M);
+    if (!TM)
+        return TM.takeError();
+
+    PipelineTuningOptions PTO;
+    PTO.LoopVectorization = PTO.SLPVectorization = Level >= 2;
+    PassInstrumentationCallbacks PIC;
+    Optional<PassClock> Clock;
+    if (isTimingPasses())
+        Clock.emplace(PIC, M);
+    PassBuilder PB(*TM, PTO, None, &PIC);
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    // Tell the vectorizers which math intrinsics have vector versions.  This
+    // must be registered before PassBuilder's default library info.
+    TargetLibraryInfoImpl TLII((*TM)->getTargetTriple());
+    TLII.addVectorizableFunctionsFromVecLib(VectorMath);
+    FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    if (Level == 1)
     {
-        if (auto *FnIR = FnAST->codegen())
-        {
-            fprintf(stderr, "Read function definition:");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            ExitOnErr(TheJIT->addModule(
-                ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-            InitializeModuleAndPassManager();
-        }
+        if (auto Err = PB.parsePassPipeline(MPM, O1Pipeline))
+            return Err;
     }
     else
-    {
-        // Skip token for error recovery.
-        getNextToken();
-    }
+        MPM = PB.buildPerModuleDefaultPipeline(Level == 2 ? OptimizationLevel::O2
+                                                          : OptimizationLevel::O3);
+    MPM.run(M, MAM);
+    if (Clock)
+        Clock->fold();
+
+    // Bodies imported from other modules were only there to be inlined.
+    for (Function &F : M)
+        if (F.hasAvailableExternallyLinkage())
+            F.deleteBody();
+    return Error::success();
 }
 
-static void HandleExtern()
+/// internalizeModule - Give the definitions in M that are not in Roots
+/// internal linkage and the fast calling convention, then drop those nothing
+/// reaches from a root.  Only valid when M holds every caller of them; the
+/// optimizer can then also drop unused arguments and inline without keeping
+/// an out-of-line copy.
+static void internalizeModule(Module &M, const StringSet<> &Roots)
 {
-    if (auto ProtoAST = ParseExtern())
-    {
-        if (auto *FnIR = ProtoAST->codegen())
+    for (Function &F : M)
+        if (!F.isDeclaration() && !Roots.count(F.getName()))
         {
-            fprintf(stderr, "Read extern: ");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
-            FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+            F.setLinkage(GlobalValue::InternalLinkage);
+            F.setCallingConv(CallingConv::Fast);
         }
-    }
-    else
-    {
-        // Skip token for error recovery.
-        getNextToken();
-    }
+
+    // A call must use the convention of its callee.
+    for (Function &F : M)
+        for (Instruction &I : instructions(F))
+            if (auto *Call = dyn_cast<CallInst>(&I))
+                if (Function *Callee = Call->getCalledFunction())
+                    Call->setCallingConv(Callee->getCallingConv());
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    GlobalDCEPass().run(M, MAM);
 }
 
-static void HandleTopLevelExpression()
+/// getExportedNames - The definitions a whole program must keep visible:
+/// those marked 'export', or all of them if none is.
+static StringSet<> getExportedNames(ArrayRef<std::unique_ptr<FunctionAST>> Defs)
 {
-    // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr())
-    {
-        if (FnAST->codegen())
-        {
-            // Create a ResourceTracker to track JIT'd memory allocated to our
-            // anonymous expression -- that way we can free it after executing.
-            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-
-            auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-            ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-            InitializeModuleAndPassManager();
+    bool AnyExported = any_of(Defs, [](const auto &D) { return D->isExported(); });
+    StringSet<> Names;
+    for (auto &D : Defs)
+        if (D->isExported() || !AnyExported)
+            Names.insert(Symbols.getName(D->getName()));
+    return Names;
+}
 
-            // Search the JIT for the __anon_expr symbol.
-            auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+/// getOptimizationPipelineID - Names what OptimizeModule does at each level,
+/// for the object cache, which sees a module's level in its bitcode.  Change
+/// it along with the pipelines.
+static std::string getOptimizationPipelineID()
+{
+    return std::string("npm;O1=") + O1Pipeline +
+           ";O2=default<O2>;O3=default<O3>;vecmath=" +
+           std::to_string((int)VectorMath);
+}
 
-            // Get the symbol's address and cast it to the right type (takes no
-            // arguments, returns a double) so we can call it as a native function.
-            double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-            fprintf(stderr, "Evaluated to %f\n", FP());
+//===----------------------------------------------------------------------===//
+// Cross-Module Inlining
+//===----------------------------------------------------------------------===//
 
-            // Delete the anonymous expression module from the JIT.
-            ExitOnErr(RT->remove());
-        }
-    }
-    else
-    {
-        // Skip token for error recovery.
-        getNextToken();
-    }
-}
+static cl::opt<unsigned> ImportInstrLimit(
+    "xmodule-import-limit",
+    cl::desc("Import the bodies of definitions of up to this many "
+             "instructions into later modules that call them (0 disables)"),
+    cl::init(24));
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop()
+/// RetainedBody - Bitcode of a module defining just one function, kept for
+/// definitions handed to the JIT.  Only a hot-swapped definition can be
+/// redefined, and its new body replaces the kept one.
+struct RetainedBody
+{
+    std::string Bitcode;
+    unsigned NumInstrs;
+};
+
+static StringMap<RetainedBody> RetainedBodies;
+
+/// KeepSnapshots - Whether to keep the definitions too large to import as
+/// well, for map kernels and :freeze.  Nothing in a batch run asks for them.
+static bool KeepSnapshots = true;
+
+/// ModuleSnapshots - Bitcode of the module each such definition was compiled
+/// in, written once per module.  The bodies are cut out of it on demand, and
+/// it is freed once no definition still points at it.
+static StringMap<std::shared_ptr<const std::string>> ModuleSnapshots;
+
+/// retainBody - Keep F's body, as optimized as it is at this point.  Copies
+/// just F, with declarations of what it calls, so the cost is F's size
+/// rather than its module's.  Returns false for a body that calls private
+/// definitions, which cannot be imported elsewhere.
+static bool retainBody(const Function &F)
+{
+    auto Body = std::make_unique<Module>(F.getName(), F.getContext());
+    Body->setDataLayout(F.getParent()->getDataLayout());
+    Function *NewF = Function::Create(F.getFunctionType(), F.getLinkage(),
+                                      F.getName(), *Body);
+    ValueToValueMapTy VMap;
+    VMap[&F] = NewF;
+    for (const Instruction &I : instructions(F))
+        if (auto *Call = dyn_cast<CallInst>(&I))
+            if (const Function *Callee = Call->getCalledFunction())
+            {
+                if (Callee->hasLocalLinkage())
+                    return false;
+                if (VMap.count(Callee))
+                    continue;
+                Function *Decl =
+                    Function::Create(Callee->getFunctionType(),
+                                     Function::ExternalLinkage,
+                                     Callee->getName(), *Body);
+                Decl->copyAttributesFrom(Callee);
+                VMap[Callee] = Decl;
+            }
+
+    auto NewArg = NewF->arg_begin();
+    for (const Argument &Arg : F.args())
+    {
+        NewArg->setName(Arg.getName());
+        VMap[&Arg] = &*NewArg++;
+    }
+    SmallVector<ReturnInst *, 4> Returns;
+    CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::DifferentModule,
+                      Returns);
+    // Cloning into another module leaves an empty llvm.dbg.cu behind, which
+    // the bitcode reader would warn about without a debug info version.
+    StripDebugInfo(*Body);
+
+    std::string Bitcode;
+    raw_string_ostream OS(Bitcode);
+    WriteBitcodeToFile(*Body, OS);
+    RetainedBodies[F.getName()] = {std::move(OS.str()),
+                                   F.getInstructionCount()};
+    return true;
+}
+
+/// retainDefinitions - Keep the bodies of M's definitions for modules still
+/// to come: those small enough to import one by one, and, if snapshots are
+/// kept, the rest in a snapshot of M.
+static void retainDefinitions(Module &M)
+{
+    SmallVector<StringRef, 4> Large;
+    for (Function &F : M)
+    {
+        if (F.isDeclaration() || !F.hasExternalLinkage() ||
+            F.getName().startswith(Symbols.getName(sym_anon_expr)))
+            continue;
+        // A hot-swapped redefinition replaces whatever was kept before.
+        if (ImportInstrLimit && !HotSwap &&
+            F.getInstructionCount() <= ImportInstrLimit && retainBody(F))
+            ModuleSnapshots.erase(F.getName());
+        else if (KeepSnapshots)
+        {
+            RetainedBodies.erase(F.getName());
+            Large.push_back(F.getName());
+        }
+    }
+    if (Large.empty())
+        return;
+
+    std::string Bitcode;
+    raw_string_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+    auto Snapshot = std::make_shared<const std::string>(std::move(OS.str()));
+    for (StringRef Name : Large)
+        ModuleSnapshots[Name] = Snapshot;
+}
+
+/// getRetainedBody - The kept body of Name, cut out of its module's snapshot
+/// the first time it is asked for, along with the rest of that module's
+/// definitions.  Returns null if there is none.
+static const RetainedBody *getRetainedBody(StringRef Name)
+{
+    auto SI = ModuleSnapshots.find(Name);
+    if (SI != ModuleSnapshots.end())
+    {
+        auto Snapshot = SI->second;
+        LLVMContext Ctx;
+        auto M = ExitOnErr(
+            parseBitcodeFile(MemoryBufferRef(*Snapshot, Name), Ctx));
+        for (Function &F : *M)
+        {
+            auto FI = ModuleSnapshots.find(F.getName());
+            if (FI == ModuleSnapshots.end() || FI->second != Snapshot)
+                continue;
+            retainBody(F);
+            ModuleSnapshots.erase(FI);
+        }
+    }
+
+    auto BI = RetainedBodies.find(Name);
+    return BI == RetainedBodies.end() ? nullptr : &BI->second;
+}
+
+/// importDefinition - Link the retained body of Name into M as
+/// available_externally, so the optimizer can inline it while the JIT still
+/// links calls that remain to the original.  Returns null if there is no
+/// body to import.
+static Function *importDefinition(Module &M, StringRef Name)
+{
+    const RetainedBody *Body = getRetainedBody(Name);
+    if (!Body)
+        return nullptr;
+    Function *Existing = M.getFunction(Name);
+    if (Existing && !Existing->isDeclaration())
+        return Existing;
+
+    std::string NameStr = Name.str(); // Name may point into M.
+    auto Src = ExitOnErr(parseBitcodeFile(
+        MemoryBufferRef(Body->Bitcode, NameStr), M.getContext()));
+    if (Linker::linkModules(M, std::move(Src)))
+        return nullptr;
+
+    Function *F = M.getFunction(NameStr);
+    F->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    return F;
+}
+
+/// importDefinitions - Import the small definitions M calls, and those their
+/// bodies call in turn.  A hot-swapped body must stay behind its stub, where
+/// a redefinition reaches every caller.
+static void importDefinitions(Module &M)
+{
+    if (!ImportInstrLimit || HotSwap || getModuleOptLevel(M) == 0)
+        return;
+
+    SmallVector<Function *, 8> Worklist;
+    for (Function &F : M)
+        if (F.isDeclaration() && !F.use_empty())
+            Worklist.push_back(&F);
+
+    while (!Worklist.empty())
+    {
+        Function *Decl = Worklist.pop_back_val();
+        auto BI = RetainedBodies.find(Decl->getName());
+        if (!Decl->isDeclaration() || BI == RetainedBodies.end() ||
+            BI->second.NumInstrs > ImportInstrLimit)
+            continue;
+
+        Function *F = importDefinition(M, Decl->getName());
+        if (!F)
+            continue;
+        for (Instruction &I : instructions(F))
+            if (auto *Call = dyn_cast<CallInst>(&I))
+                if (Function *Callee = Call->getCalledFunction())
+                    if (Callee->isDeclaration())
+                        Worklist.push_back(Callee);
+    }
+}
+
+/// finalizeModule - Get TheModule ready for the JIT: import the small
+/// definitions it calls, optimize it unless the JIT will, and keep its own
+/// definitions for modules still to come, unless there are none.
+static void finalizeModule(bool MoreToCome = true)
+{
+    timeStage(StageImport, [] { importDefinitions(*TheModule); });
+    if (!deferOptimization())
+        ExitOnErr(OptimizeModule(*TheModule));
+    if (MoreToCome)
+        timeStage(StageRetain, [] { retainDefinitions(*TheModule); });
+}
+
+//===----------------------------------------------------------------------===//
+// Tier-0 Interpreter
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+    Tiered("tiered",
+           cl::desc("Interpret definitions and top-level expressions, and "
+                    "JIT-compile only the functions that get hot"));
+
+static cl::opt<unsigned> TierUpThreshold(
+    "tier-up-threshold",
+    cl::desc("Interpreted calls after which a definition is JIT-compiled"),
+    cl::init(1000));
+
+/// MaxNativeArgs - The most arguments the interpreter can pass to native code.
+static constexpr unsigned MaxNativeArgs = 8;
+
+namespace
+{
+
+    /// FunctionRecord - What the tiered driver knows about a function: the
+    /// definition it interprets, and the native code to call instead once the
+    /// JIT has compiled it.  Externs only ever have the latter.
+    struct FunctionRecord
+    {
+        SymbolID Name;
+        unsigned NumArgs;
+        std::unique_ptr<FunctionAST> AST; // Null for externs.
+        BumpPtrAllocator Arena;           // Owns the nodes of AST's body.
+        SmallVector<FunctionRecord *, 4> Callees;
+        unsigned Calls = 0;                  // Interpreted calls so far.
+        bool Promoted = false;               // Handed to the JIT.
+        std::atomic<void *> Native{nullptr}; // Set once native code is ready.
+    };
+
+} // end anonymous namespace
+
+static DenseMap<SymbolID, std::unique_ptr<FunctionRecord>> FunctionRecords;
+
+/// ArgSlots/ResolvingFn - State of the resolve walk.  ResolvingFn is the
+/// definition being resolved, or null for a top-level expression.
+static DenseMap<SymbolID, unsigned> ArgSlots;
+static FunctionRecord *ResolvingFn;
+
+static void InitializeModule();
+
+/// getFunctionRecord - Find the record for a call target, creating one for an
+/// extern the first time it is called.
+static FunctionRecord *getFunctionRecord(SymbolID Name)
+{
+    auto RI = FunctionRecords.find(Name);
+    if (RI != FunctionRecords.end())
+        return RI->second.get();
+
+    auto PI = FunctionProtos.find(Name);
+    if (PI == FunctionProtos.end())
+        return nullptr;
+    if (PI->second->getArgs().size() > MaxNativeArgs)
+    {
+        LogError("Too many arguments for an interpreted extern call");
+        return nullptr;
+    }
+
+    auto Sym = TheJIT->lookup(Symbols.getName(Name));
+    if (!Sym)
+    {
+        logAllUnhandledErrors(Sym.takeError(), errs(), "Error: ");
+        return nullptr;
+    }
+
+    auto &R = FunctionRecords[Name];
+    R = std::make_unique<FunctionRecord>();
+    R->Name = Name;
+    R->NumArgs = PI->second->getArgs().size();
+    R->Promoted = true;
+    R->Native = jitTargetAddressToPointer<void *>(Sym->getAddress());
+    return R.get();
+}
+
+bool VariableExprAST::resolve()
+{
+    auto SI = ArgSlots.find(Name);
+    if (SI == ArgSlots.end())
+    {
+        LogError("Unknown variable name");
+        return false;
+    }
+    Slot = SI->second;
+    return true;
+}
+
+bool BinaryExprAST::resolve()
+{
+    if (!LHS->resolve() || !RHS->resolve())
+        return false;
+
+    const BinopInfo &Info = BinopTable[(unsigned char)Op];
+    if (!Info.UserDefined)
+        return true;
+
+    Target = getFunctionRecord(Info.Fn);
+    if (!Target)
+    {
+        LogError("binary operator not found!");
+        return false;
+    }
+    if (ResolvingFn)
+        ResolvingFn->Callees.push_back(Target);
+    return true;
+}
+
+bool CallExprAST::resolve()
+{
+    Target = getFunctionRecord(Callee);
+    if (!Target)
+    {
+        LogError("Unknown function referenced");
+        return false;
+    }
+    if (Target->NumArgs != Args.size())
+    {
+        LogError("Incorrect # arguments passed");
+        return false;
+    }
+
+    for (ExprAST *Arg : Args)
+        if (!Arg->resolve())
+            return false;
+
+    if (ResolvingFn)
+        ResolvingFn->Callees.push_back(Target);
+    return true;
+}
+
+/// callNative - Call a double(double, ...) function with a runtime argument
+/// count.
+static double callNative(void *Fn, ArrayRef<double> A)
+{
+    using D = double;
+    switch (A.size())
+    {
+    case 0:
+        return ((D(*)())Fn)();
+    case 1:
+        return ((D(*)(D))Fn)(A[0]);
+    case 2:
+        return ((D(*)(D, D))Fn)(A[0], A[1]);
+    case 3:
+        return ((D(*)(D, D, D))Fn)(A[0], A[1], A[2]);
+    case 4:
+        return ((D(*)(D, D, D, D))Fn)(A[0], A[1], A[2], A[3]);
+    case 5:
+        return ((D(*)(D, D, D, D, D))Fn)(A[0], A[1], A[2], A[3], A[4]);
+    case 6:
+        return ((D(*)(D, D, D, D, D, D))Fn)(A[0], A[1], A[2], A[3], A[4], A[5]);
+    case 7:
+        return ((D(*)(D, D, D, D, D, D, D))Fn)(A[0], A[1], A[2], A[3], A[4],
+                                               A[5], A[6]);
+    case 8:
+        return ((D(*)(D, D, D, D, D, D, D, D))Fn)(A[0], A[1], A[2], A[3], A[4],
+                                                  A[5], A[6], A[7]);
+    }
+    llvm_unreachable("too many arguments for a native call");
+}
+
+/// collectForPromotion - Post-order walk over F and the definitions it calls
+/// that have not been handed to the JIT yet, so callees are generated first.
+static void collectForPromotion(FunctionRecord &F,
+                                SmallVectorImpl<FunctionRecord *> &Order)
+{
+    if (F.Promoted)
+        return;
+    F.Promoted = true;
+    for (FunctionRecord *Callee : F.Callees)
+        collectForPromotion(*Callee, Order);
+    Order.push_back(&F);
+}
+
+/// promote - Compile F, along with everything it calls that is still
+/// interpreted, in one module.  Each function switches to native code when
+/// the JIT reports it ready, which with compile threads happens in the
+/// background while the interpreter keeps going.
+static void promote(FunctionRecord &F)
+{
+    SmallVector<FunctionRecord *, 8> Order;
+    collectForPromotion(F, Order);
+    for (FunctionRecord *R : Order)
+        timeStage(StageCodegen, [&] { return R->AST->codegen(); });
+    finalizeModule();
+
+    addDefinitionModule(
+        ThreadSafeModule(std::move(TheModule), std::move(TheContext)));
+    InitializeModule();
+
+    for (FunctionRecord *R : Order)
+    {
+        if (R->NumArgs > MaxNativeArgs)
+            continue;
+        TheJIT->lookupAsync(
+            Symbols.getName(R->Name),
+            [R](Expected<JITEvaluatedSymbol> Sym)
+            {
+                if (!Sym)
+                    return logAllUnhandledErrors(Sym.takeError(), errs(),
+                                                 "Error: ");
+                R->Native.store(
+                    jitTargetAddressToPointer<void *>(Sym->getAddress()),
+                    std::memory_order_release);
+            });
+    }
+}
+
+/// callFunction - Run F on Args: natively once it has been compiled, and
+/// otherwise in the interpreter, counting the call towards promotion.
+static double callFunction(FunctionRecord &F, ArrayRef<double> Args)
+{
+    if (void *Native = F.Native.load(std::memory_order_acquire))
+        return callNative(Native, Args);
+
+    if (!F.Promoted && ++F.Calls >= TierUpThreshold)
+        promote(F);
+
+    return F.AST->getBody()->interpret(Args.data());
+}
+
+double BinaryExprAST::interpret(const double *Frame)
+{
+    double L = LHS->interpret(Frame);
+    double R = RHS->interpret(Frame);
+    if (!Target)
+        return *evalBuiltinBinop(Op, L, R);
+
+    double Ops[] = {L, R};
+    return callFunction(*Target, Ops);
+}
+
+double CallExprAST::interpret(const double *Frame)
+{
+    SmallVector<double, 8> ArgVals;
+    for (ExprAST *Arg : Args)
+        ArgVals.push_back(Arg->interpret(Frame));
+    return callFunction(*Target, ArgVals);
+}
+
+/// TierDefinition - Record a definition for the interpreter instead of
+/// compiling it.
+static void TierDefinition(std::unique_ptr<FunctionAST> FnAST)
+{
+    SymbolID Name = FnAST->getName();
+    if (FunctionRecords.count(Name))
+    {
+        LogError("Function cannot be redefined.");
+        return;
+    }
+
+    auto &R = FunctionRecords[Name];
+    R = std::make_unique<FunctionRecord>();
+    R->Name = Name;
+    R->NumArgs = FnAST->getProto().getArgs().size();
+
+    ArgSlots.clear();
+    for (unsigned I = 0; I != R->NumArgs; ++I)
+        ArgSlots[FnAST->getProto().getArgs()[I]] = I;
+    ResolvingFn = R.get();
+    bool Resolved = FnAST->getBody()->resolve();
+    ResolvingFn = nullptr;
+    if (!Resolved)
+    {
+        FunctionRecords.erase(Name);
+        return;
+    }
+
+    // The body must outlive this top-level item, so take over its arena.
+    R->AST = std::move(FnAST);
+    R->Arena = std::move(ASTArena);
+    fprintf(stderr, "Read function definition: %s (interpreted)\n",
+            Symbols.getName(Name).str().c_str());
+}
+
+/// TierTopLevelExpression - Evaluate a top-level expression in the
+/// interpreter, without involving LLVM at all.
+static Optional<double> TierTopLevelExpression(FunctionAST &FnAST)
+{
+    ArgSlots.clear();
+    if (!FnAST.getBody()->resolve())
+        return None;
+    return FnAST.getBody()->interpret(nullptr);
+}
+
+//===----------------------------------------------------------------------===//
+// Map Kernels
+//===----------------------------------------------------------------------===//
+
+/// MapKernel - Computes Out[I] = F(Columns[0][I], Columns[1][I], ...) for
+/// every row I < N, where F is the definition the kernel was generated for.
+using MapKernel = void (*)(const double *const *Columns, double *Out,
+                           int64_t N);
+
+/// MapKernels - Kernels generated so far, each in a module of its own, as a
+/// kernel inlines the current body of its definition.
+struct MapKernelModule
+{
+    MapKernel Kernel;
+    ResourceTrackerSP RT;
+};
+
+static DenseMap<SymbolID, MapKernelModule> MapKernels;
+
+/// dropMapKernel - Free the kernel for Name, if any, before its body changes.
+static void dropMapKernel(SymbolID Name)
+{
+    auto KI = MapKernels.find(Name);
+    if (KI == MapKernels.end())
+        return;
+    ExitOnErr(TheJIT->removeModule(KI->second.RT));
+    MapKernels.erase(KI);
+}
+
+/// clearMapKernels - Free every kernel, while the JIT is alive.
+static void clearMapKernels()
+{
+    for (auto &Entry : MapKernels)
+        ExitOnErr(TheJIT->removeModule(Entry.second.RT));
+    MapKernels.clear();
+}
+
+/// emitMapKernel - Generate Name.map into M as a plain row loop around a call
+/// to Name, with Name's body imported so that the loop vectorizer sees
+/// straight-line arithmetic once it is inlined.
+static void emitMapKernel(Module &M, StringRef Name, unsigned NumArgs)
+{
+    LLVMContext &Ctx = M.getContext();
+    Type *DoubleTy = Type::getDoubleTy(Ctx);
+    Type *PtrTy = DoubleTy->getPointerTo();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+    Function *F = importDefinition(M, Name);
+    if (F)
+        F->addFnAttr(Attribute::AlwaysInline);
+    else // An extern, or a definition the JIT has not seen yet.
+        F = Function::Create(
+            FunctionType::get(DoubleTy, SmallVector<Type *, 8>(NumArgs, DoubleTy),
+                              false),
+            Function::ExternalLinkage, Name, M);
+    importDefinitions(M);
+
+    Function *Kernel = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx),
+                          {PtrTy->getPointerTo(), PtrTy, Int64Ty}, false),
+        Function::ExternalLinkage, Name + ".map", M);
+    Kernel->addParamAttr(1, Attribute::NoAlias);
+
+    auto ArgI = Kernel->arg_begin();
+    Value *Columns = &*ArgI++, *Out = &*ArgI++, *N = &*ArgI;
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Kernel);
+    BasicBlock *Loop = BasicBlock::Create(Ctx, "loop", Kernel);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", Kernel);
+
+    IRBuilder<> B(Entry);
+    SmallVector<Value *, 8> ColumnPtrs;
+    for (unsigned I = 0; I != NumArgs; ++I)
+        ColumnPtrs.push_back(
+            B.CreateLoad(PtrTy, B.CreateConstInBoundsGEP1_64(PtrTy, Columns, I)));
+    B.CreateCondBr(B.CreateICmpSGT(N, B.getInt64(0)), Loop, Exit);
+
+    B.SetInsertPoint(Loop);
+    PHINode *Row = B.CreatePHI(Int64Ty, 2, "row");
+    Row->addIncoming(B.getInt64(0), Entry);
+    SmallVector<Value *, 8> Args;
+    for (Value *Column : ColumnPtrs)
+        Args.push_back(
+            B.CreateLoad(DoubleTy, B.CreateInBoundsGEP(DoubleTy, Column, Row)));
+    B.CreateStore(B.CreateCall(F, Args),
+                  B.CreateInBoundsGEP(DoubleTy, Out, Row));
+    Value *Next = B.CreateNSWAdd(Row, B.getInt64(1));
+    Row->addIncoming(Next, Loop);
+    B.CreateCondBr(B.CreateICmpSLT(Next, N), Loop, Exit);
+
+    B.SetInsertPoint(Exit);
+    B.CreateRetVoid();
+    verifyFunction(*Kernel);
+}
+
+/// getMapKernel - The map kernel for Name, generated, optimized at -O3 and
+/// compiled on first use.
+static Expected<MapKernel> getMapKernel(SymbolID Name, unsigned &NumArgs)
+{
+    // An interpreted definition has no IR, or even a prototype, yet.
+    if (Tiered)
+    {
+        auto RI = FunctionRecords.find(Name);
+        if (RI != FunctionRecords.end() && !RI->second->Promoted)
+            promote(*RI->second);
+    }
+
+    auto PI = FunctionProtos.find(Name);
+    if (PI == FunctionProtos.end())
+        return createStringError(inconvertibleErrorCode(),
+                                 "Unknown function referenced");
+    NumArgs = PI->second->getArgs().size();
+
+    auto KI = MapKernels.find(Name);
+    if (KI != MapKernels.end())
+        return KI->second.Kernel;
+
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = std::make_unique<Module>("map kernel", *Ctx);
+    M->setDataLayout(TheJIT->getDataLayout());
+    setModuleOptLevel(*M, 3);
+    emitMapKernel(*M, Symbols.getName(Name), NumArgs);
+    if (!deferOptimization())
+        ExitOnErr(OptimizeModule(*M));
+
+    std::string KernelName = (Symbols.getName(Name) + ".map").str();
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+    if (auto Err = TheJIT->addModule(
+            ThreadSafeModule(std::move(M), std::move(Ctx)), RT))
+        return std::move(Err);
+    auto Sym = TheJIT->lookup(KernelName);
+    if (!Sym)
+    {
+        ExitOnErr(TheJIT->removeModule(RT));
+        return Sym.takeError();
+    }
+
+    auto Kernel = jitTargetAddressToPointer<MapKernel>(Sym->getAddress());
+    MapKernels[Name] = {Kernel, RT};
+    return Kernel;
+}
+
+/// mapFunction - Bulk evaluation: Out[I] = Name(Columns[0][I], ...) for every
+/// row of Out, with one column per argument of Name.
+static Error mapFunction(StringRef Name, ArrayRef<const double *> Columns,
+                         MutableArrayRef<double> Out)
+{
+    unsigned NumArgs;
+    auto Kernel = getMapKernel(Symbols.intern(Name), NumArgs);
+    if (!Kernel)
+        return Kernel.takeError();
+    if (Columns.size() != NumArgs)
+        return createStringError(inconvertibleErrorCode(),
+                                 "Incorrect # columns passed");
+    (*Kernel)(Columns.data(), Out.data(), Out.size());
+    return Error::success();
+}
+
+static cl::opt<unsigned> MapThreads(
+    "map-threads",
+    cl::desc("Threads for parallel map evaluation (0 uses every core)"),
+    cl::init(0));
+
+static cl::opt<unsigned> MapChunkRows(
+    "map-chunk-rows",
+    cl::desc("Rows each parallel map worker takes at a time"),
+    cl::init(1 << 16));
+
+/// getMapThreadPool - The workers for parallelMapFunction, started on first
+/// use and kept apart from the JIT's compile threads.
+static ThreadPool &getMapThreadPool()
+{
+    static ThreadPool Pool(hardware_concurrency(MapThreads));
+    return Pool;
+}
+
+/// parallelMapFunction - mapFunction spread over the map thread pool.  The
+/// rows are cut into chunks of MapChunkRows that workers claim one at a time,
+/// so a worker that finishes early takes over the remaining chunks rather
+/// than idling behind a fixed share.  Results are written straight into Out.
+static Error parallelMapFunction(StringRef Name,
+                                 ArrayRef<const double *> Columns,
+                                 MutableArrayRef<double> Out)
+{
+    unsigned NumArgs;
+    auto Kernel = getMapKernel(Symbols.intern(Name), NumArgs);
+    if (!Kernel)
+        return Kernel.takeError();
+    if (Columns.size() != NumArgs)
+        return createStringError(inconvertibleErrorCode(),
+                                 "Incorrect # columns passed");
+
+    size_t Rows = Out.size();
+    size_t ChunkRows = std::max(1u, (unsigned)MapChunkRows);
+    size_t NumChunks = divideCeil(Rows, ChunkRows);
+    ThreadPool &Pool = getMapThreadPool();
+    size_t NumWorkers = std::min<size_t>(Pool.getThreadCount(), NumChunks);
+
+    std::atomic<size_t> NextChunk{0};
+    for (size_t W = 0; W != NumWorkers; ++W)
+        Pool.async(
+            [&]()
+            {
+                SmallVector<const double *, 8> ChunkColumns(NumArgs);
+                for (size_t C; (C = NextChunk++) < NumChunks;)
+                {
+                    size_t Begin = C * ChunkRows;
+                    for (unsigned A = 0; A != NumArgs; ++A)
+                        ChunkColumns[A] = Columns[A] + Begin;
+                    (*Kernel)(ChunkColumns.data(), Out.data() + Begin,
+                              std::min(ChunkRows, Rows - Begin));
+                }
+            });
+    Pool.wait();
+    return Error::success();
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and JIT Driver
+//===----------------------------------------------------------------------===//
+
+static void InitializeModule()
+{
+    // Open a new context and module.
+    TheContext = std::make_unique<LLVMContext>();
+    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+    TheModule->setDataLayout(TheJIT->getDataLayout());
+
+    setModuleOptLevel(*TheModule, OptLevel);
+
+    // Create a new builder for the module.
+    Builder = std::make_unique<IRBuilder<>>(*TheContext);
+}
+
+static unsigned NumAnonExprs;
+
+static cl::opt<unsigned> ExprCacheKB(
+    "expr-cache-kb",
+    cl::desc("Keep compiled top-level expressions for reuse, in up to this "
+             "much JIT memory (0 compiles every expression afresh)"),
+    cl::init(4096));
+
+static cl::opt<unsigned> ExprCacheEntries(
+    "expr-cache-entries",
+    cl::desc("Keep at most this many compiled top-level expressions, as each "
+             "also costs the JIT bookkeeping beyond its code pages"),
+    cl::init(256));
+
+/// CachedExpr - A compiled top-level expression kept in the JIT.
+struct CachedExpr
+{
+    std::string Key;
+    ResourceTrackerSP RT;
+    double (*FP)();
+    size_t Bytes;
+    SmallVector<SymbolID, 4> Callees;
+};
+
+/// ExprLRU/ExprCache - Cached expressions, most recently used first, and
+/// indexed by key.  The key is the expression's structure plus everything
+/// else that changes its code; a definition that changes evicts the entries
+/// calling it, so callee versions need not be part of the key.
+static std::list<CachedExpr> ExprLRU;
+static StringMap<std::list<CachedExpr>::iterator> ExprCache;
+static size_t ExprCacheBytes;
+static unsigned ExprCacheHits, ExprCacheMisses;
+
+/// getExprCacheKey - The cache key for FnAST's body, compiled as it would be
+/// now.  Fills Callees with the functions it calls.
+static std::string getExprCacheKey(const FunctionAST &FnAST,
+                                   SmallVectorImpl<SymbolID> &Callees)
+{
+    static FlatExpr Flat;
+    Flat.assign(FnAST.getBody());
+    std::string Key;
+    Key += char('0' + getModuleOptLevel(*TheModule));
+    Key += char('0' + FnAST.getFPMode());
+    Flat.appendKey(Key);
+    Flat.collectCallees(Callees);
+    return Key;
+}
+
+static void evictCachedExpr(std::list<CachedExpr>::iterator I)
+{
+    ExprCacheBytes -= I->Bytes;
+    ExprCache.erase(I->Key);
+    ExitOnErr(TheJIT->removeModule(I->RT));
+    ExprLRU.erase(I);
+}
+
+/// insertCachedExpr - Keep E, evicting the least recently used expressions
+/// to make room.  An expression bigger than the whole budget is not kept.
+/// E.Bytes is what the JIT mapped for it, at least a page per section kind.
+static void insertCachedExpr(CachedExpr E)
+{
+    size_t Budget = size_t(ExprCacheKB) * 1024;
+    if (E.Bytes > Budget || !ExprCacheEntries)
+    {
+        ExitOnErr(TheJIT->removeModule(E.RT));
+        return;
+    }
+    while (ExprCacheBytes + E.Bytes > Budget ||
+           ExprLRU.size() >= ExprCacheEntries)
+        evictCachedExpr(std::prev(ExprLRU.end()));
+
+    ExprCacheBytes += E.Bytes;
+    ExprLRU.push_front(std::move(E));
+    ExprCache[ExprLRU.front().Key] = ExprLRU.begin();
+}
+
+/// invalidateCachedExprs - Drop the expressions that call Name, whose
+/// definition is about to change.
+static void invalidateCachedExprs(SymbolID Name)
+{
+    for (auto I = ExprLRU.begin(); I != ExprLRU.end();)
+    {
+        auto Next = std::next(I);
+        if (is_contained(I->Callees, Name))
+            evictCachedExpr(I);
+        I = Next;
+    }
+}
+
+/// clearExprCache - Free every cached expression, while the JIT is alive.
+static void clearExprCache()
+{
+    while (!ExprLRU.empty())
+        evictCachedExpr(ExprLRU.begin());
+}
+
+/// SwappableBody - Under -hot-swap, the latest version of a definition's
+/// body, which its stub reaches, and the tracker of the module holding it.
+struct SwappableBody
+{
+    unsigned Version = 0;
+    ResourceTrackerSP RT;
+};
+
+static DenseMap<SymbolID, SwappableBody> SwappableBodies;
+
+/// getNextBodyName - The name for a new version of Name's body, as in "f$v2".
+static std::string getNextBodyName(SymbolID Name)
+{
+    return (Symbols.getName(Name) + "$v" +
+            Twine(++SwappableBodies[Name].Version))
+        .str();
+}
+
+/// swapInBody - Point the stub for Name at BodyName, held by the module under
+/// RT.  The module of the body it replaces is freed once no other definition
+/// reaches into it.  No JIT'd code runs while the REPL handles input, so no
+/// thread can still be inside the old body.
+static void swapInBody(SymbolID Name, StringRef BodyName, ResourceTrackerSP RT)
+{
+    ExitOnErr(TheJIT->redirect(Symbols.getName(Name), BodyName));
+    ResourceTrackerSP Old = std::exchange(SwappableBodies[Name].RT, RT);
+    if (!Old || any_of(SwappableBodies, [&](const auto &Entry)
+                       { return Entry.second.RT == Old; }))
+        return;
+    ExitOnErr(TheJIT->removeModule(Old));
+}
+
+static void HandleDefinition()
+{
+    if (auto FnAST = timeStage(StageParse, ParseDefinition))
+    {
+        SymbolID Name = FnAST->getName();
+        // Callers reach a hot-swapped definition through its stub, so only
+        // code with its old body inlined goes stale.
+        if (HotSwap && SwappableBodies.count(Name))
+        {
+            if (FunctionProtos[Name]->getArgs().size() !=
+                FnAST->getProto().getArgs().size())
+            {
+                LogError("Redefinition must take the same number of arguments");
+                return;
+            }
+            dropMapKernel(Name);
+        }
+        else
+            invalidateCachedExprs(Name);
+
+        if (Tiered)
+            TierDefinition(std::move(FnAST));
+        else if (auto *FnIR =
+                     timeStage(StageCodegen, [&] { return FnAST->codegen(); }))
+        {
+            finalizeModule();
+            fprintf(stderr, "Read function definition:");
+            FnIR->print(errs());
+            fprintf(stderr, "\n");
+
+            // A hot-swapped body gets a name and a module of its own, so the
+            // stub can move on to the next version and the old one be freed.
+            std::string BodyName = Symbols.getName(Name).str();
+            ResourceTrackerSP RT;
+            if (HotSwap)
+            {
+                BodyName = getNextBodyName(Name);
+                FnIR->setName(BodyName);
+                RT = TheJIT->getMainJITDylib().createResourceTracker();
+            }
+            addDefinitionModule(
+                ThreadSafeModule(std::move(TheModule), std::move(TheContext)),
+                RT);
+            InitializeModule();
+            if (HotSwap)
+                swapInBody(Name, BodyName, RT);
+
+            // Get the compile threads going on it before anyone asks.
+            if (CompileThreads && !LazyCompile)
+                TheJIT->compileAsync(StringRef(BodyName));
+        }
+    }
+    else
+    {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+}
+
+static void HandleExtern()
+{
+    if (auto ProtoAST = timeStage(StageParse, ParseExtern))
+    {
+        invalidateCachedExprs(ProtoAST->getName());
+        if (auto *FnIR = ProtoAST->codegen())
+        {
+            fprintf(stderr, "Read extern: ");
+            FnIR->print(errs());
+            fprintf(stderr, "\n");
+            FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+        }
+    }
+    else
+    {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+}
+
+/// EvaluateTopLevelExpression - Run a parsed top-level expression and return
+/// its value, or None if it failed to compile.
+static Optional<double> EvaluateTopLevelExpression(FunctionAST &FnAST)
+{
+    // The parser has already folded a constant expression to its value, so
+    // calculator-style input never reaches LLVM.
+    if (auto *Num = dyn_cast<NumberExprAST>(FnAST.getBody()))
+        return Num->getVal();
+
+    if (Tiered)
+        return timeStage(StageInterpret,
+                         [&] { return TierTopLevelExpression(FnAST); });
+
+    // Run the code compiled for the same expression last time, if any.
+    std::string Key;
+    SmallVector<SymbolID, 4> Callees;
+    if (ExprCacheKB)
+    {
+        Key = getExprCacheKey(FnAST, Callees);
+        auto CI = ExprCache.find(Key);
+        if (CI != ExprCache.end())
+        {
+            ++ExprCacheHits;
+            ExprLRU.splice(ExprLRU.begin(), ExprLRU, CI->second);
+            return timeStage(StageRun, CI->second->FP);
+        }
+        ++ExprCacheMisses;
+    }
+
+    // Evaluate a top-level expression into an anonymous function.  Each gets
+    // a name of its own, so profiles can tell them apart.
+    Function *ExprF = timeStage(StageCodegen, [&] { return FnAST.codegen(); });
+    if (!ExprF)
+        return None;
+    ExprF->setName("__anon_expr." + Twine(++NumAnonExprs));
+    std::string ExprName = ExprF->getName().str();
+    finalizeModule();
+
+    // Create a ResourceTracker to track JIT'd memory allocated to our
+    // anonymous expression -- that way we can free it after executing.
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+
+    auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+    timeStage(StageAdd,
+              [&] { ExitOnErr(TheJIT->addModule(std::move(TSM), RT)); });
+    InitializeModule();
+
+    // Search the JIT for the expression's symbol.  This is where it is
+    // compiled, unless the compile threads got there first.
+    auto ExprSymbol = timeStage(
+        StageLookup, [&] { return ExitOnErr(TheJIT->lookup(ExprName)); });
+
+    // Get the symbol's address and cast it to the right type (takes no
+    // arguments, returns a double) so we can call it as a native function.
+    double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+    double Result = timeStage(StageRun, FP);
+
+    // Keep the code for next time, or delete the anonymous expression module
+    // from the JIT.
+    if (ExprCacheKB)
+        insertCachedExpr({std::move(Key), RT, FP, TheJIT->getLoadedBytes(*RT),
+                          std::move(Callees)});
+    else
+        ExitOnErr(TheJIT->removeModule(RT));
+    return Result;
+}
+
+static void HandleTopLevelExpression()
+{
+    if (auto FnAST = timeStage(StageParse, [] { return ParseTopLevelExpr(); }))
+    {
+        if (auto Result = EvaluateTopLevelExpression(*FnAST))
+            fprintf(stderr, "Evaluated to %f\n", *Result);
+    }
+    else
+    {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+}
+
+static double Seconds();
+
+/// MaxMapRows - The most rows :map generates, 512 MiB per column.
+static constexpr size_t MaxMapRows = size_t(1) << 26;
+
+/// RunMapCommand - Map Name over Rows rows of generated input with its map
+/// kernel, and report the throughput against calling it once per row.
+static void RunMapCommand(SymbolID Name, size_t Rows)
+{
+    // Generate and compile the kernel up front, so only the run is timed.
+    unsigned NumArgs;
+    auto Kernel = getMapKernel(Name, NumArgs);
+    if (!Kernel)
+    {
+        logAllUnhandledErrors(Kernel.takeError(), errs(), "Error: ");
+        return;
+    }
+
+    std::vector<std::vector<double>> Columns(NumArgs, std::vector<double>(Rows));
+    std::vector<const double *> ColumnPtrs;
+    for (unsigned C = 0; C != NumArgs; ++C)
+    {
+        for (size_t I = 0; I != Rows; ++I)
+            Columns[C][I] = C + (I % 1000) * 0.001;
+        ColumnPtrs.push_back(Columns[C].data());
+    }
+    std::vector<double> Out(Rows);
+
+    StringRef FnName = Symbols.getName(Name);
+    double Start = Seconds();
+    ExitOnErr(mapFunction(FnName, ColumnPtrs, Out));
+    double MapSecs = Seconds() - Start;
+
+    Start = Seconds();
+    ExitOnErr(parallelMapFunction(FnName, ColumnPtrs, Out));
+    double ParallelSecs = Seconds() - Start;
+
+    double Sum = 0;
+    for (double V : Out)
+        Sum += V;
+    fprintf(stderr, "Mapped %s over %zu rows: %.1f Mrows/s, %.1f Mrows/s on %u "
+                    "threads",
+            FnName.str().c_str(), Rows, Rows / MapSecs / 1e6,
+            Rows / ParallelSecs / 1e6, getMapThreadPool().getThreadCount());
+
+    if (NumArgs <= MaxNativeArgs)
+    {
+        auto Sym = ExitOnErr(TheJIT->lookup(FnName));
+        void *Fn = jitTargetAddressToPointer<void *>(Sym.getAddress());
+        SmallVector<double, 8> Args(NumArgs);
+        Start = Seconds();
+        for (size_t I = 0; I != Rows; ++I)
+        {
+            for (unsigned C = 0; C != NumArgs; ++C)
+                Args[C] = ColumnPtrs[C][I];
+            Out[I] = callNative(Fn, Args);
+        }
+        double CallSecs = Seconds() - Start;
+        fprintf(stderr, " (%.1f Mrows/s calling per row)", Rows / CallSecs / 1e6);
+    }
+    fprintf(stderr, ", sum %f\n", Sum);
+}
+
+/// FreezeSession - Link the retained IR of every definition into one module,
+/// optimize it as a whole at -O3 and swap it in for the modules they were
+/// compiled in one at a time.  Every definition stays external, as later
+/// input may call any of them.  Under -hot-swap the definitions still call
+/// each other through their stubs, so later redefinitions reach every caller;
+/// freezing then recompiles each body at -O3 and gathers them in one module.
+static void FreezeSession()
+{
+    // Interpreted definitions have no IR yet.
+    if (Tiered)
+    {
+        SmallVector<FunctionRecord *, 16> Cold;
+        for (auto &Entry : FunctionRecords)
+            if (!Entry.second->Promoted)
+                Cold.push_back(Entry.second.get());
+        for (FunctionRecord *R : Cold)
+            if (!R->Promoted)
+                promote(*R);
+    }
+
+    std::vector<std::string> InSnapshots;
+    for (auto &Entry : ModuleSnapshots)
+        InSnapshots.push_back(Entry.first().str());
+    for (const std::string &Name : InSnapshots)
+        getRetainedBody(Name);
+
+    if (RetainedBodies.empty())
+    {
+        fprintf(stderr, "Nothing to freeze\n");
+        return;
+    }
+
+    double Start = Seconds();
+    std::vector<StringRef> Names;
+    for (auto &Entry : RetainedBodies)
+        Names.push_back(Entry.first());
+    llvm::sort(Names);
+
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = std::make_unique<Module>("frozen", *Ctx);
+    M->setDataLayout(TheJIT->getDataLayout());
+    setModuleOptLevel(*M, 3);
+    for (StringRef Name : Names)
+    {
+        auto Body = ExitOnErr(parseBitcodeFile(
+            MemoryBufferRef(RetainedBodies[Name].Bitcode, Name), *Ctx));
+        if (Linker::linkModules(*M, std::move(Body)))
+        {
+            LogError("Could not link the definitions for :freeze");
+            return;
+        }
+    }
+
+    // Rename each hot-swapped body to its next version, and send the calls
+    // other definitions make to it back through the stub.
+    std::vector<std::string> BodyNames;
+    if (HotSwap)
+        for (StringRef Name : Names)
+        {
+            Function *F = M->getFunction(Name);
+            BodyNames.push_back(getNextBodyName(Symbols.intern(Name)));
+            F->setName(BodyNames.back());
+            Function *Stub = Function::Create(
+                F->getFunctionType(), Function::ExternalLinkage, Name, *M);
+            F->replaceUsesWithIf(Stub,
+                                 [F](Use &U)
+                                 {
+                                     auto *I = dyn_cast<Instruction>(U.getUser());
+                                     return !I || I->getFunction() != F;
+                                 });
+        }
+    if (!deferOptimization())
+        ExitOnErr(OptimizeModule(*M));
+
+    if (HotSwap)
+    {
+        // Cached expressions and map kernels call definitions through their
+        // stubs too, so they can stay.
+        auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+        ExitOnErr(TheJIT->addModule(
+            ThreadSafeModule(std::move(M), std::move(Ctx)), RT));
+        for (size_t I = 0, E = Names.size(); I != E; ++I)
+            swapInBody(Symbols.intern(Names[I]), BodyNames[I], RT);
+    }
+    else
+    {
+        // Drop everything compiled against the old modules, then swap.
+        clearExprCache();
+        clearMapKernels();
+        ExitOnErr(TheJIT->replaceDefinitions(
+            ThreadSafeModule(std::move(M), std::move(Ctx))));
+    }
+
+    // Compile now, and point interpreted callers at the new code.
+    for (size_t I = 0, E = Names.size(); I != E; ++I)
+    {
+        StringRef Name = Names[I];
+        auto Sym =
+            ExitOnErr(TheJIT->lookup(HotSwap ? StringRef(BodyNames[I]) : Name));
+        auto RI = FunctionRecords.find(Symbols.intern(Name));
+        if (RI != FunctionRecords.end() && RI->second->NumArgs <= MaxNativeArgs)
+            RI->second->Native.store(
+                jitTargetAddressToPointer<void *>(Sym.getAddress()),
+                std::memory_order_release);
+    }
+    fprintf(stderr, "Froze %zu definition(s) in %.3f s\n", Names.size(),
+            Seconds() - Start);
+}
+
+/// command ::= ':' 'opt' number
+///         ::= ':' 'map' identifier number
+///         ::= ':' 'fp' ('strict' | 'contract' | 'fast')
+///
+/// HandleCommand - REPL commands start with ':', which cannot begin a
+/// top-level item.
+static void HandleCommand()
+{
+    getNextToken(); // eat ':'.
+    if (CurTok != tok_identifier)
+    {
+        LogError("Expected a command name after ':'");
+        return;
+    }
+
+    if (IdentifierStr == "opt")
+    {
+        // Later definitions are optimized at the new level; the flag on the
+        // module being filled makes it apply to the very next one.
+        getNextToken(); // eat 'opt'.
+        if (CurTok != tok_number || NumVal != (unsigned)NumVal || NumVal > 3)
+        {
+            LogError("Expected an optimization level from 0 to 3");
+            if (CurTok == tok_number)
+                getNextToken(); // Skip the bad level for error recovery.
+            return;
+        }
+        OptLevel = (unsigned)NumVal;
+        setModuleOptLevel(*TheModule, OptLevel);
+        // Report before reading on, which would wait for more input.
+        fprintf(stderr, "Optimizing at -O%u\n", (unsigned)OptLevel);
+        getNextToken(); // eat the level.
+        return;
+    }
+
+    if (IdentifierStr == "fp")
+    {
+        // Applies to definitions and expressions read from now on.
+        getNextToken(); // eat 'fp'.
+        if (CurTok == tok_identifier && IdentifierStr == "strict")
+            FloatMode = FPStrict;
+        else if (CurTok == tok_identifier && IdentifierStr == "contract")
+            FloatMode = FPContract;
+        else if (CurTok == tok_identifier && IdentifierStr == "fast")
+            FloatMode = FPFast;
+        else
+        {
+            LogError("Expected strict, contract or fast after :fp");
+            if (CurTok == tok_identifier)
+                getNextToken(); // Skip the bad mode for error recovery.
+            return;
+        }
+        // Report before reading on, which would wait for more input.
+        fprintf(stderr, "Floating-point mode: %s\n",
+                FloatMode == FPStrict     ? "strict"
+                : FloatMode == FPContract ? "contract"
+                                          : "fast");
+        getNextToken(); // eat the mode.
+        return;
+    }
+
+    if (IdentifierStr == "map")
+    {
+        getNextToken(); // eat 'map'.
+        if (CurTok != tok_identifier)
+        {
+            LogError("Expected a function name after :map");
+            return;
+        }
+        SymbolID Name = IdentifierSym;
+        getNextToken(); // eat the name.
+        // Range-check before the cast, which is undefined for huge values.
+        if (CurTok != tok_number || NumVal < 1 || NumVal > MaxMapRows ||
+            NumVal != (size_t)NumVal)
+        {
+            LogError(("Expected a row count from 1 to " + Twine(MaxMapRows) +
+                      " after the function name")
+                         .str()
+                         .c_str());
+            if (CurTok == tok_number)
+                getNextToken(); // Skip the bad count for error recovery.
+            return;
+        }
+        // Map before reading on, which would wait for more input.
+        RunMapCommand(Name, (size_t)NumVal);
+        getNextToken(); // eat the row count.
+        return;
+    }
+
+    if (IdentifierStr == "freeze")
+    {
+        // Freeze before reading on, which would wait for more input.
+        FreezeSession();
+        getNextToken(); // eat 'freeze'.
+        return;
+    }
+
+    if (IdentifierStr == "stats")
+    {
+        // Report before reading on, which would wait for more input.
+        printStageTimes();
+        if (ExprCacheKB)
+            fprintf(stderr,
+                    "Expression cache: %u hits, %u misses, %zu entries in %zu "
+                    "bytes\n",
+                    ExprCacheHits, ExprCacheMisses, ExprLRU.size(),
+                    ExprCacheBytes);
+        getNextToken(); // eat 'stats'.
+        return;
+    }
+
+    if (IdentifierStr == "passes")
+    {
+        getNextToken(); // eat 'passes'.
+        if (CurTok != tok_identifier)
+        {
+            LogError("Expected a function name after :passes");
+            return;
+        }
+        printPassTimes(IdentifierStr);
+        getNextToken(); // eat the name.
+        return;
+    }
+
+    LogError("Unknown command");
+    getNextToken(); // Skip the name for error recovery.
+}
+
+/// top ::= definition | external | expression | command | ';'
+static void MainLoop()
 {
     while (true)
     {
@@ -705,16 +3412,473 @@ static void MainLoop()
             getNextToken();
             break;
         case tok_def:
+        case tok_export:
             HandleDefinition();
             break;
         case tok_extern:
-            HandleExtern();
+            HandleExtern();
+            break;
+        case ':':
+            HandleCommand();
+            break;
+        default:
+            HandleTopLevelExpression();
+            break;
+        }
+
+        // Release the AST of the item we just handled in one go.
+        ASTArena.Reset();
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Batch Driver
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+    BatchMode("batch",
+              cl::desc("Parse the whole input, compile all definitions into "
+                       "shared modules, then run the top-level expressions"));
+
+static cl::opt<unsigned> BatchModules(
+    "batch-modules",
+    cl::desc("Number of modules to spread the definitions of a batch across"),
+    cl::init(1));
+
+/// ParseWholeInput - Parse the rest of the input, collecting definitions and
+/// top-level expressions and registering externs.  Redefinitions are rejected
+/// here, and expressions are named __anon_expr.N so they can share a module.
+/// Parsing goes on past an error to report the rest, but returns false if
+/// there was any.
+static bool ParseWholeInput(std::vector<std::unique_ptr<FunctionAST>> &Defs,
+                            std::vector<std::unique_ptr<FunctionAST>> &Exprs)
+{
+    DenseSet<SymbolID> Defined;
+    bool Parsed = true;
+    while (CurTok != tok_eof)
+    {
+        switch (CurTok)
+        {
+        case ';': // ignore top-level semicolons.
+            getNextToken();
+            break;
+        case tok_def:
+        case tok_export:
+            if (auto FnAST = ParseDefinition())
+            {
+                // The JIT would reject the duplicate only once the modules
+                // are added, so catch redefinitions across modules here.
+                if (Defined.insert(FnAST->getName()).second)
+                    Defs.push_back(std::move(FnAST));
+                else
+                {
+                    LogError("Function cannot be redefined.");
+                    Parsed = false;
+                }
+            }
+            else
+            {
+                getNextToken(); // Skip token for error recovery.
+                Parsed = false;
+            }
+            break;
+        case tok_extern:
+            if (auto ProtoAST = ParseExtern())
+                FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+            else
+            {
+                getNextToken(); // Skip token for error recovery.
+                Parsed = false;
+            }
             break;
         default:
-            HandleTopLevelExpression();
+        {
+            // Each expression needs its own name in the shared module.
+            SymbolID Name = Symbols.intern("__anon_expr." +
+                                           std::to_string(Exprs.size()));
+            if (auto FnAST = ParseTopLevelExpr(Name))
+                Exprs.push_back(std::move(FnAST));
+            else
+            {
+                getNextToken(); // Skip token for error recovery.
+                Parsed = false;
+            }
             break;
         }
+        }
+    }
+    return Parsed;
+}
+
+/// RunBatch - Non-interactive driver.  Instead of one module per definition,
+/// codegen every definition into BatchModules modules and hand them to the JIT
+/// together.  Top-level expressions are compiled into one further module and
+/// evaluated in source order once all definitions are in place.  LookedUpLater
+/// names a definition the caller will look up afterwards, if not empty.
+/// Returns false if any of the input failed to parse or compile.  Nothing is
+/// run unless every definition compiled; an expression that failed is left
+/// out.
+static bool RunBatch(StringRef LookedUpLater)
+{
+    std::vector<std::unique_ptr<FunctionAST>> Defs, Exprs;
+    if (!ParseWholeInput(Defs, Exprs))
+        return false;
+    bool Compiled = true;
+
+    size_t NumModules = std::max(1u, (unsigned)BatchModules);
+    size_t PerModule = std::max<size_t>(1, divideCeil(Defs.size(), NumModules));
+
+    // With every definition in one module, only those called from outside it
+    // need to stay visible.
+    bool Internalize = PerModule >= Defs.size();
+    StringSet<> Roots;
+    if (Internalize)
+    {
+        Roots = getExportedNames(Defs);
+        FlatExpr Flat;
+        SmallVector<SymbolID, 8> Callees;
+        for (auto &FnAST : Exprs)
+        {
+            Flat.assign(FnAST->getBody());
+            Flat.collectCallees(Callees);
+        }
+        for (SymbolID Callee : Callees)
+            Roots.insert(Symbols.getName(Callee));
+        if (!LookedUpLater.empty())
+            Roots.insert(LookedUpLater);
+    }
+
+    // A batch has no :map or :freeze, and imports only into its own later
+    // modules.  The map driver inlines LookedUpLater's body into its kernel.
+    KeepSnapshots = false;
+    for (size_t Begin = 0; Begin < Defs.size(); Begin += PerModule)
+    {
+        std::vector<StringRef> Names;
+        for (size_t I = Begin, E = std::min(Begin + PerModule, Defs.size());
+             I != E; ++I)
+        {
+            StringRef Name = Symbols.getName(Defs[I]->getName());
+            if (!Defs[I]->codegen())
+                Compiled = false;
+            else if (!Internalize || Roots.count(Name))
+                Names.push_back(Name);
+        }
+        if (Internalize)
+            internalizeModule(*TheModule, Roots);
+        finalizeModule(Begin + PerModule < Defs.size() || !Exprs.empty());
+        if (Function *F = TheModule->getFunction(LookedUpLater))
+            if (!F->isDeclaration())
+                timeStage(StageRetain, [&] { return retainBody(*F); });
+        addDefinitionModule(
+            ThreadSafeModule(std::move(TheModule), std::move(TheContext)));
+        InitializeModule();
+
+        // With compile threads, the modules are optimized and compiled in
+        // parallel while we generate IR for the next one.
+        if (CompileThreads && !LazyCompile)
+            TheJIT->compileAsync(Names);
+    }
+
+    // Expressions the parser folded to a constant need no code; they keep an
+    // empty name and their value.
+    std::vector<std::pair<std::string, double>> Results;
+    bool NeedsJIT = false, ExprsCompiled = true;
+    for (auto &FnAST : Exprs)
+    {
+        if (auto *Num = dyn_cast<NumberExprAST>(FnAST->getBody()))
+            Results.emplace_back(std::string(), Num->getVal());
+        else if (auto *FnIR = FnAST->codegen())
+        {
+            Results.emplace_back(FnIR->getName().str(), 0.0);
+            NeedsJIT = true;
+        }
+        else
+            ExprsCompiled = false;
+    }
+    ASTArena.Reset();
+    if (!Compiled)
+        return false;
+
+    ResourceTrackerSP RT;
+    if (NeedsJIT)
+    {
+        finalizeModule(/*MoreToCome=*/false);
+        RT = TheJIT->getMainJITDylib().createResourceTracker();
+        ExitOnErr(TheJIT->addModule(
+            ThreadSafeModule(std::move(TheModule), std::move(TheContext)), RT));
+        InitializeModule();
+    }
+
+    for (auto &Result : Results)
+    {
+        double Val = Result.second;
+        if (!Result.first.empty())
+        {
+            auto ExprSymbol = ExitOnErr(TheJIT->lookup(Result.first));
+            double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+            Val = FP();
+        }
+        fprintf(stderr, "Evaluated to %f\n", Val);
+    }
+
+    if (RT)
+        ExitOnErr(TheJIT->removeModule(RT));
+    return ExprsCompiled;
+}
+
+//===----------------------------------------------------------------------===//
+// AOT Driver
+//===----------------------------------------------------------------------===//
+
+enum EmitKind
+{
+    EmitNone,
+    EmitObject,
+    EmitArchive,
+    EmitShared
+};
+
+static cl::opt<EmitKind> Emit(
+    "emit",
+    cl::desc("Compile the input ahead of time instead of running it"),
+    cl::values(clEnumValN(EmitObject, "obj", "A relocatable object file"),
+               clEnumValN(EmitArchive, "lib", "A static archive"),
+               clEnumValN(EmitShared, "shared", "A shared library")),
+    cl::init(EmitNone));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("AOT output file"),
+                                           cl::value_desc("filename"));
+
+static cl::opt<std::string> AOTLinker(
+    "aot-linker", cl::desc("Compiler driver used to link -emit=shared"),
+    cl::init("cc"));
+
+/// createAOTTargetMachine - A position-independent TargetMachine for the host
+/// triple, so that the output links into archives and shared libraries alike.
+static Expected<std::unique_ptr<TargetMachine>> createAOTTargetMachine()
+{
+    std::string TripleStr = sys::getDefaultTargetTriple();
+    std::string Err;
+    const Target *T = TargetRegistry::lookupTarget(TripleStr, Err);
+    if (!T)
+        return createStringError(inconvertibleErrorCode(), Err);
+
+    std::unique_ptr<TargetMachine> TM(T->createTargetMachine(
+        TripleStr, "generic", "", TargetOptions(), Reloc::PIC_));
+    if (!TM)
+        return createStringError(inconvertibleErrorCode(),
+                                 "Could not create a target machine for " +
+                                     TripleStr);
+    return std::move(TM);
+}
+
+/// emitObject - Compile M to an object file in memory.
+static Expected<std::unique_ptr<MemoryBuffer>> emitObject(TargetMachine &TM,
+                                                          Module &M)
+{
+    SmallVector<char, 0> Obj;
+    raw_svector_ostream OS(Obj);
+    legacy::PassManager PM;
+    if (TM.addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile))
+        return createStringError(inconvertibleErrorCode(),
+                                 "The target cannot emit object files");
+    PM.run(M);
+    return std::make_unique<SmallVectorMemoryBuffer>(std::move(Obj));
+}
+
+/// linkShared - Link a single object into a shared library with the system
+/// compiler driver.
+static Error linkShared(MemoryBufferRef Obj, StringRef Output)
+{
+    SmallString<128> ObjPath;
+    int FD;
+    if (auto EC = sys::fs::createTemporaryFile("kaleidoscope", "o", FD, ObjPath))
+        return createFileError(ObjPath, EC);
+    FileRemover RemoveObj(ObjPath);
+    {
+        raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS << Obj.getBuffer();
+    }
+
+    auto Linker = sys::findProgramByName(AOTLinker);
+    if (!Linker)
+        return createStringError(Linker.getError(), "Cannot find " + AOTLinker);
+    SmallVector<StringRef, 8> Args = {*Linker, "-shared", "-o", Output, ObjPath};
+    // Vectorized math calls need their library at load time.
+    if (VectorMath == TargetLibraryInfoImpl::LIBMVEC_X86)
+        Args.push_back("-lmvec");
+    else if (VectorMath == TargetLibraryInfoImpl::SVML)
+        Args.push_back("-lsvml");
+    std::string ErrMsg;
+    if (sys::ExecuteAndWait(*Linker, Args, None, {}, 0, 0, &ErrMsg) != 0)
+        return createStringError(inconvertibleErrorCode(),
+                                 AOTLinker + " failed" +
+                                     (ErrMsg.empty() ? "" : ": " + ErrMsg));
+    return Error::success();
+}
+
+/// getDefaultOutputFilename - The input's name with the extension for Kind,
+/// in the current directory.
+static std::string getDefaultOutputFilename(StringRef Input, EmitKind Kind)
+{
+    StringRef Stem = Input == "-" ? "a" : sys::path::stem(Input);
+    switch (Kind)
+    {
+    case EmitObject:
+        return (Stem + ".o").str();
+    case EmitArchive:
+        return ("lib" + Stem + ".a").str();
+    case EmitShared:
+        return ("lib" + Stem + ".so").str();
+    case EmitNone:
+        break;
+    }
+    llvm_unreachable("not an AOT output");
+}
+
+/// RunAOT - Compile every definition of the input into one module, optimize
+/// it at -O, and write it out as Emit says.  Each definition becomes
+/// an external double(double...) symbol under its own name.  Nothing is
+/// written unless all of the input parses and compiles.
+static int RunAOT(StringRef Input)
+{
+    std::vector<std::unique_ptr<FunctionAST>> Defs, Exprs;
+    if (!ParseWholeInput(Defs, Exprs))
+        return 1;
+    if (!Exprs.empty())
+        fprintf(stderr, "Warning: ignoring %zu top-level expression(s); only "
+                        "definitions are compiled ahead of time\n",
+                Exprs.size());
+
+    auto TM = ExitOnErr(createAOTTargetMachine());
+    TheModule->setTargetTriple(TM->getTargetTriple().str());
+    TheModule->setDataLayout(TM->createDataLayout());
+    TheModule->setModuleIdentifier(Input);
+
+    for (auto &FnAST : Defs)
+        if (!FnAST->codegen())
+            return 1;
+    StringSet<> Exported = getExportedNames(Defs);
+    internalizeModule(*TheModule, Exported);
+    ExitOnErr(OptimizeModule(*TheModule));
+
+    // Internalized definitions that were inlined everywhere are gone now.
+    size_t NumEmitted = count_if(
+        *TheModule, [](const Function &F) { return !F.isDeclaration(); });
+
+    auto Obj = ExitOnErr(emitObject(*TM, *TheModule));
+    std::string Output = OutputFilename.empty()
+                             ? getDefaultOutputFilename(Input, Emit)
+                             : OutputFilename;
+    switch (Emit)
+    {
+    case EmitObject:
+    {
+        std::error_code EC;
+        raw_fd_ostream OS(Output, EC, sys::fs::OF_None);
+        if (EC)
+            ExitOnErr(createFileError(Output, EC));
+        OS << Obj->getBuffer();
+        break;
+    }
+    case EmitArchive:
+    {
+        std::string MemberName = sys::path::stem(Output).str() + ".o";
+        NewArchiveMember Member(MemoryBufferRef(Obj->getBuffer(), MemberName));
+        auto Kind = TM->getTargetTriple().isOSDarwin()
+                        ? object::Archive::K_DARWIN
+                        : object::Archive::K_GNU;
+        ExitOnErr(writeArchive(Output, Member, /*WriteSymtab=*/true, Kind,
+                               /*Deterministic=*/true, /*Thin=*/false));
+        break;
+    }
+    case EmitShared:
+        ExitOnErr(linkShared(*Obj, Output));
+        break;
+    case EmitNone:
+        llvm_unreachable("not an AOT run");
+    }
+
+    fprintf(stderr, "Wrote %zu definition(s) to %s, %u exported\n", NumEmitted,
+            Output.c_str(), Exported.size());
+    return 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Map Driver
+//===----------------------------------------------------------------------===//
+
+static cl::opt<std::string> MapDriverFunction(
+    "map",
+    cl::desc("Once the input has run, evaluate this definition over the rows "
+             "of -map-columns in parallel and write -map-output"),
+    cl::value_desc("function"));
+
+static cl::list<std::string> MapColumnFiles(
+    "map-columns", cl::CommaSeparated,
+    cl::desc("Column files of native doubles, one per argument of -map"),
+    cl::value_desc("file,..."));
+
+static cl::opt<std::string> MapOutputFile(
+    "map-output", cl::desc("File the -map results are written to"),
+    cl::value_desc("file"));
+
+/// RunMapDriver - Map MapDriverFunction over the column files.  Inputs are
+/// mapped into memory and the workers write results directly into the
+/// output file's buffer.
+static int RunMapDriver()
+{
+    if (MapOutputFile.empty())
+    {
+        fprintf(stderr, "Error: -map needs -map-output\n");
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<MemoryBuffer>> Buffers;
+    std::vector<const double *> Columns;
+    size_t Rows = 0;
+    for (auto &Path : MapColumnFiles)
+    {
+        // Large files are mapped, and small ones read into aligned memory.
+        auto Buf = ExitOnErr(errorOrToExpected(MemoryBuffer::getFile(
+            Path, /*IsText=*/false, /*RequiresNullTerminator=*/false)));
+        if (!Buf->getBufferSize())
+        {
+            fprintf(stderr, "Error: %s is empty\n", Path.c_str());
+            return 1;
+        }
+        if (!isAddrAligned(Align::Of<double>(), Buf->getBufferStart()))
+        {
+            fprintf(stderr, "Error: %s was not loaded aligned for doubles\n",
+                    Path.c_str());
+            return 1;
+        }
+        size_t N = Buf->getBufferSize() / sizeof(double);
+        if (Buf->getBufferSize() % sizeof(double) || (!Columns.empty() && N != Rows))
+        {
+            fprintf(stderr, "Error: %s does not hold %s doubles\n", Path.c_str(),
+                    Columns.empty() ? "whole" : "as many");
+            return 1;
+        }
+        Rows = N;
+        Columns.push_back(reinterpret_cast<const double *>(Buf->getBufferStart()));
+        Buffers.push_back(std::move(Buf));
     }
+
+    auto Out = ExitOnErr(
+        FileOutputBuffer::create(MapOutputFile, Rows * sizeof(double)));
+    double Start = Seconds();
+    ExitOnErr(parallelMapFunction(
+        MapDriverFunction, Columns,
+        makeMutableArrayRef(reinterpret_cast<double *>(Out->getBufferStart()),
+                            Rows)));
+    double Secs = Seconds() - Start;
+    ExitOnErr(Out->commit());
+
+    fprintf(stderr, "Mapped %s over %zu rows on %u threads in %.3f s\n",
+            MapDriverFunction.c_str(), Rows, getMapThreadPool().getThreadCount(),
+            Secs);
+    return 0;
 }
 
 //===----------------------------------------------------------------------===//
@@ -741,33 +3905,560 @@ extern "C" DLLEXPORT double printd(double X)
     return 0;
 }
 
+//===----------------------------------------------------------------------===//
+// Benchmarks
+//===----------------------------------------------------------------------===//
+
+enum BenchKind
+{
+    NoBench,
+    BenchLexer,
+    BenchAST,
+    BenchParser,
+    BenchREPL,
+    BenchCache
+};
+
+static cl::opt<BenchKind> Bench(
+    "bench", cl::desc("Run a front-end benchmark instead of the REPL"),
+    cl::values(clEnumValN(BenchLexer, "lexer", "Lexer throughput in MB/s"),
+               clEnumValN(BenchAST, "ast",
+                          "Parse+codegen time, tree vs. flat expressions"),
+               clEnumValN(BenchParser, "parser",
+                          "Operator precedence lookup and long-chain parsing"),
+               clEnumValN(BenchREPL, "repl",
+                          "Latency of constant top-level expressions, folded "
+                          "vs. compiled"),
+               clEnumValN(BenchCache, "cache",
+                          "Startup time with a cold vs. warm object cache")),
+    cl::init(NoBench));
+
+static cl::opt<unsigned> BenchSizeMB(
+    "bench-size-mb",
+    cl::desc("Size of the generated benchmark input when no file is given"),
+    cl::init(64));
+
+/// Seconds - Wall-clock timer for the benchmarks.
+static double Seconds()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+/// generateLexerWorkload - Produce roughly Bytes of Kaleidoscope source with a
+/// realistic mix of identifiers, numbers, operators and comments.
+static std::string generateLexerWorkload(size_t Bytes)
+{
+    std::string Text;
+    Text.reserve(Bytes + 128);
+    for (unsigned I = 0; Text.size() < Bytes; ++I)
+    {
+        Text += "# helper number " + std::to_string(I) + "\n";
+        Text += "def fn" + std::to_string(I) + "(alpha beta) alpha*beta + " +
+                std::to_string(I) + ".25 - (beta < alpha) * fn" +
+                std::to_string(I / 2) + "(alpha, 2.5);\n";
+    }
+    return Text;
+}
+
+/// gettokStdio - The original lexer, pulling each character through stdio.
+/// Kept only as the baseline for the lexer benchmark.
+static int gettokStdio(FILE *F)
+{
+    static int LastChar = ' ';
+    static std::string IdentifierStr;
+
+    while (isspace(LastChar))
+        LastChar = getc(F);
+
+    if (isalpha(LastChar))
+    {
+        IdentifierStr = LastChar;
+        while (isalnum((LastChar = getc(F))))
+            IdentifierStr += LastChar;
+
+        if (IdentifierStr == "def")
+            return tok_def;
+        if (IdentifierStr == "extern")
+            return tok_extern;
+        return tok_identifier;
+    }
+
+    if (isdigit(LastChar) || LastChar == '.')
+    {
+        std::string NumStr;
+        do
+        {
+            NumStr += LastChar;
+            LastChar = getc(F);
+        } while (isdigit(LastChar) || LastChar == '.');
+
+        NumVal = strtod(NumStr.c_str(), nullptr);
+        return tok_number;
+    }
+
+    if (LastChar == '#')
+    {
+        do
+            LastChar = getc(F);
+        while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+
+        if (LastChar != EOF)
+            return gettokStdio(F);
+    }
+
+    if (LastChar == EOF)
+        return tok_eof;
+
+    int ThisChar = LastChar;
+    LastChar = getc(F);
+    return ThisChar;
+}
+
+/// reportThroughput - Print one benchmark result line.
+static void reportThroughput(const char *Name, size_t Bytes, size_t Tokens,
+                             double Secs)
+{
+    printf("%-8s %10zu tokens %8.3f s %10.1f MB/s\n", Name, Tokens, Secs,
+           Bytes / Secs / (1024 * 1024));
+}
+
+/// lexAll - Drain the current input source, returning the token count.
+static size_t lexAll()
+{
+    size_t Tokens = 0;
+    while (gettok() != tok_eof)
+        ++Tokens;
+    return Tokens;
+}
+
+/// RunLexerBenchmark - Lex the same input through stdio (the old getchar loop),
+/// the block-buffered stream reader, the mmap path and an in-memory string.
+static int RunLexerBenchmark(StringRef Filename)
+{
+    // Materialize the workload as a file so every path reads the same bytes.
+    SmallString<128> Path(Filename);
+    std::string Text;
+    if (Filename == "-")
+    {
+        Text = generateLexerWorkload(size_t(BenchSizeMB) * 1024 * 1024);
+        int FD;
+        ExitOnErr(errorCodeToError(
+            sys::fs::createTemporaryFile("kaleidoscope-lex", "ks", FD, Path)));
+        raw_fd_ostream(FD, /*shouldClose=*/true) << Text;
+    }
+    else
+    {
+        auto Buf = ExitOnErr(errorOrToExpected(MemoryBuffer::getFile(Filename)));
+        Text = Buf->getBuffer().str();
+    }
+    size_t Bytes = Text.size();
+
+    FILE *F = fopen(Path.c_str(), "rb");
+    if (!F)
+    {
+        fprintf(stderr, "Error: cannot open %s\n", Path.c_str());
+        return 1;
+    }
+    double Start = Seconds();
+    size_t StdioTokens = 0;
+    while (gettokStdio(F) != tok_eof)
+        ++StdioTokens;
+    reportThroughput("getchar", Bytes, StdioTokens, Seconds() - Start);
+    fclose(F);
+
+    auto FileOrErr = sys::fs::openNativeFileForRead(Path);
+    ExitOnErr(FileOrErr.takeError());
+    setInputSource(std::make_unique<StreamInputSource>(*FileOrErr,
+                                                       /*OwnsFile=*/true));
+    Start = Seconds();
+    size_t Tokens = lexAll();
+    reportThroughput("stream", Bytes, Tokens, Seconds() - Start);
+
+    setInputSource(ExitOnErr(openInputSource(Path)));
+    Start = Seconds();
+    Tokens = lexAll();
+    reportThroughput("mmap", Bytes, Tokens, Seconds() - Start);
+
+    setInputSource(createStringSource(Text));
+    Start = Seconds();
+    Tokens = lexAll();
+    reportThroughput("string", Bytes, Tokens, Seconds() - Start);
+
+    if (Filename == "-")
+        sys::fs::remove(Path);
+
+    if (Tokens != StdioTokens)
+    {
+        fprintf(stderr, "Error: token count mismatch (%zu vs %zu)\n", Tokens,
+                StdioTokens);
+        return 1;
+    }
+    return 0;
+}
+
+/// generateDeepWorkload - Definitions whose bodies nest Depth levels deep
+/// through parentheses, alternating operators and calls.
+static std::string generateDeepWorkload(unsigned Defs, unsigned Depth)
+{
+    std::string Text = "def leaf(a b) a*b;\n";
+    for (unsigned D = 0; D != Defs; ++D)
+    {
+        Text += "def deep" + std::to_string(D) + "(x y) ";
+        for (unsigned I = 0; I != Depth; ++I)
+            Text += I % 3 == 2 ? "leaf(x, " : I % 2 ? "y*(" : "x+(";
+        Text += "1.5";
+        Text.append(Depth, ')');
+        Text += ";\n";
+    }
+    return Text;
+}
+
+/// generateWideWorkload - Definitions whose bodies are long flat sums of
+/// Width products and calls.
+static std::string generateWideWorkload(unsigned Defs, unsigned Width)
+{
+    std::string Text = "def leaf(a b) a*b;\n";
+    for (unsigned D = 0; D != Defs; ++D)
+    {
+        Text += "def wide" + std::to_string(D) + "(x y) x";
+        for (unsigned I = 0; I != Width; ++I)
+            Text += I % 4 == 3 ? " - leaf(y, x)"
+                               : " + x*" + std::to_string(I) + " - y";
+        Text += ";\n";
+    }
+    return Text;
+}
+
+/// timeParseAndCodegen - Parse and codegen every definition in Text, without
+/// optimizing or JITing, returning the elapsed seconds.
+static double timeParseAndCodegen(StringRef Text, bool Flat)
+{
+    FlatCodegen = Flat;
+    // The previous run's module still belongs to the context that
+    // InitializeModule is about to replace.
+    TheModule.reset();
+    InitializeModule();
+
+    double Start = Seconds();
+    setInputSource(createStringSource(Text));
+    getNextToken();
+    while (CurTok != tok_eof)
+    {
+        if (CurTok == ';')
+        {
+            getNextToken();
+            continue;
+        }
+        auto FnAST = ParseDefinition();
+        if (!FnAST || !FnAST->codegen())
+            return -1;
+        ASTArena.Reset();
+    }
+    return Seconds() - Start;
+}
+
+/// RunASTBenchmark - Compare parse+codegen time of the pointer-linked tree
+/// and the flat expression form on deep and wide generated bodies.
+static int RunASTBenchmark()
+{
+    struct
+    {
+        const char *Name;
+        std::string Text;
+    } Workloads[] = {{"deep", generateDeepWorkload(200, 1500)},
+                     {"wide", generateWideWorkload(200, 1500)}};
+
+    for (auto &W : Workloads)
+    {
+        double Tree = timeParseAndCodegen(W.Text, /*Flat=*/false);
+        double Flat = timeParseAndCodegen(W.Text, /*Flat=*/true);
+        if (Tree < 0 || Flat < 0)
+            return 1;
+        printf("%-6s tree %8.3f s   flat %8.3f s   speedup %5.2fx\n", W.Name,
+               Tree, Flat, Tree / Flat);
+    }
+    return 0;
+}
+
+/// RunParserBenchmark - Time precedence lookups against the old std::map, and
+/// parsing of long operator chains mixing builtin and user-defined operators.
+static int RunParserBenchmark()
+{
+    const unsigned Defs = 2000, ChainLength = 2000;
+    const char ChainOps[] = "+*-<^+*";
+
+    // Precedence lookups on the token stream a chain would produce.
+    std::map<char, int> MapPrecedence = {
+        {'<', 10}, {'+', 20}, {'-', 20}, {'*', 40}};
+    std::vector<int> Tokens;
+    for (unsigned I = 0; I != ChainLength; ++I)
+        Tokens.push_back(I % 2 ? ChainOps[I / 2 % 7] : tok_identifier);
+
+    long Sum = 0;
+    double Start = Seconds();
+    for (unsigned Rep = 0; Rep != Defs; ++Rep)
+        for (int Tok : Tokens)
+            Sum += isascii(Tok) ? MapPrecedence[Tok] : -1;
+    double MapSecs = Seconds() - Start;
+
+    Start = Seconds();
+    for (unsigned Rep = 0; Rep != Defs; ++Rep)
+        for (int Tok : Tokens)
+        {
+            CurTok = Tok;
+            Sum += GetTokPrecedence();
+        }
+    double TableSecs = Seconds() - Start;
+
+    double Lookups = double(Defs) * ChainLength;
+    printf("lookup  map   %8.3f s %8.1f M/s\n", MapSecs, Lookups / MapSecs / 1e6);
+    printf("lookup  table %8.3f s %8.1f M/s   (map grew to %zu entries, %ld)\n",
+           TableSecs, Lookups / TableSecs / 1e6, MapPrecedence.size(), Sum);
+
+    // Parse long chains; '^' is a user-defined right-associative operator.
+    std::string Text = "def binary^ 50 right (a b) a*b;\n";
+    for (unsigned D = 0; D != Defs; ++D)
+    {
+        Text += "def chain" + std::to_string(D) + "(x y) x";
+        for (unsigned I = 0; I != ChainLength / 2; ++I)
+            Text += std::string(" ") + ChainOps[I % 7] + (I % 3 ? " y" : " 2.5");
+        Text += ";\n";
+    }
+
+    setInputSource(createStringSource(Text));
+    getNextToken();
+    Start = Seconds();
+    while (CurTok != tok_eof)
+    {
+        if (CurTok == ';')
+        {
+            getNextToken();
+            continue;
+        }
+        if (!ParseDefinition())
+            return 1;
+        ASTArena.Reset();
+    }
+    double ParseSecs = Seconds() - Start;
+    double Ops = double(Defs) * (ChainLength / 2);
+    printf("parse   chains %7.3f s %8.1f Mops/s\n", ParseSecs, Ops / ParseSecs / 1e6);
+    return 0;
+}
+
+/// timeConstantExpressions - Average seconds to parse and evaluate each of
+/// calculator-style top-level expressions First to Count.
+static double timeConstantExpressions(unsigned Count, bool Fold,
+                                      unsigned First = 0)
+{
+    std::string Text;
+    for (unsigned I = First; I != Count; ++I)
+        Text += std::to_string(I) + "+5*2 - (" + std::to_string(I % 7) +
+                " < 3.5);\n";
+
+    FoldConstants = Fold;
+    setInputSource(createStringSource(Text));
+    getNextToken();
+    double Start = Seconds();
+    while (CurTok != tok_eof)
+    {
+        if (CurTok == ';')
+        {
+            getNextToken();
+            continue;
+        }
+        auto FnAST = ParseTopLevelExpr();
+        auto Result = FnAST ? EvaluateTopLevelExpression(*FnAST) : None;
+        if (!Result)
+            return -1;
+        ASTArena.Reset();
+    }
+    return (Seconds() - Start) / (Count - First);
+}
+
+/// RunREPLBenchmark - Compare end-to-end latency of constant top-level
+/// expressions when the parser folds them, when each one is JIT-compiled, and
+/// when the same expressions come again and are found in the expression
+/// cache.  Only the expressions the cache kept come again, so that each one
+/// is a hit.
+static int RunREPLBenchmark()
+{
+    InitializeModule();
+    double Compiled = timeConstantExpressions(2000, /*Fold=*/false);
+    unsigned Kept = ExprLRU.size();
+    double Cached =
+        Kept ? timeConstantExpressions(2000, /*Fold=*/false, 2000 - Kept) : 0;
+    double Folded = timeConstantExpressions(200000, /*Fold=*/true);
+    if (Compiled < 0 || Cached < 0 || Folded < 0)
+        return 1;
+    printf("compiled %10.2f us/expr\n", Compiled * 1e6);
+    if (Kept)
+        printf("cached   %10.2f us/expr   (the last %u)\n", Cached * 1e6, Kept);
+    printf("folded   %10.2f us/expr   speedup %8.0fx\n", Folded * 1e6,
+           Compiled / Folded);
+    return 0;
+}
+
+/// timeStartup - Seconds for a fresh JIT caching objects in ObjectCacheDir to
+/// load Text the way the REPL would, compiling every definition.
+static double timeStartup(StringRef Text)
+{
+    double Start = Seconds();
+    TheModule.reset();
+    TheJIT = ExitOnErr(KaleidoscopeJIT::Create(CompileThreads));
+    TheJIT->setOptimizer(OptimizeModule, getOptimizationPipelineID());
+    ExitOnErr(TheJIT->enableObjectCache(ObjectCacheDir));
+    FunctionProtos.clear();
+    InitializeModule();
+
+    std::vector<std::string> Names;
+    setInputSource(createStringSource(Text));
+    getNextToken();
+    while (CurTok != tok_eof)
+    {
+        if (CurTok == ';')
+        {
+            getNextToken();
+            continue;
+        }
+        auto FnAST = ParseDefinition();
+        if (!FnAST || !FnAST->codegen())
+            return -1;
+        Names.push_back(Symbols.getName(FnAST->getName()).str());
+        addDefinitionModule(
+            ThreadSafeModule(std::move(TheModule), std::move(TheContext)));
+        InitializeModule();
+        ASTArena.Reset();
+    }
+    for (auto &Name : Names)
+        ExitOnErr(TheJIT->lookup(Name));
+    return Seconds() - Start;
+}
+
+/// RunCacheBenchmark - Load a generated prelude twice into an empty object
+/// cache: once cold, compiling everything, and once warm, loading objects.
+static int RunCacheBenchmark()
+{
+    SmallString<128> Dir;
+    if (auto EC = sys::fs::createUniqueDirectory("kaleidoscope-cache", Dir))
+    {
+        fprintf(stderr, "Error: %s\n", EC.message().c_str());
+        return 1;
+    }
+    ObjectCacheDir = std::string(Dir.str());
+
+    std::string Text = generateDeepWorkload(300, 200);
+    double Cold = timeStartup(Text);
+    unsigned ColdMisses = TheJIT->getObjectCache().getNumMisses();
+    double Warm = timeStartup(Text);
+    unsigned WarmHits = TheJIT->getObjectCache().getNumHits();
+    sys::fs::remove_directories(Dir);
+    if (Cold < 0 || Warm < 0)
+        return 1;
+
+    printf("cold %8.3f s   (%u objects compiled)\n", Cold, ColdMisses);
+    printf("warm %8.3f s   (%u objects loaded)   speedup %5.2fx\n", Warm,
+           WarmHits, Cold / Warm);
+    return 0;
+}
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main()
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input file>"),
+                                          cl::init("-"));
+
+int main(int argc, char **argv)
 {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+    if (OptLevel > 3)
+    {
+        fprintf(stderr, "Error: -O%u is not an optimization level\n",
+                (unsigned)OptLevel);
+        return 1;
+    }
+    if (HotSwap && (Tiered || BatchMode || Emit != EmitNone))
+    {
+        fprintf(stderr, "Error: -hot-swap only applies to the compiling REPL\n");
+        return 1;
+    }
+
     InitializeNativeTarget();
     InitializeNativeTargetAsmPrinter();
     InitializeNativeTargetAsmParser();
+    ExitOnErr(loadVectorMathLibrary());
 
     // Install standard binary operators.
     // 1 is lowest precedence.
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40; // highest.
+    defineBinop('<', 10);
+    defineBinop('+', 20);
+    defineBinop('-', 20);
+    defineBinop('*', 40); // highest.
+
+    TheJIT = ExitOnErr(KaleidoscopeJIT::Create(CompileThreads));
+    if (deferOptimization())
+        TheJIT->setOptimizer(OptimizeModule, getOptimizationPipelineID());
+    if (!ObjectCacheDir.empty())
+        ExitOnErr(TheJIT->enableObjectCache(ObjectCacheDir));
+    if (JITDebugger)
+        TheJIT->enableDebuggerSupport();
+    if (PerfMap)
+        ExitOnErr(TheJIT->enablePerfMap());
+    if (PerfJITDump)
+        ExitOnErr(TheJIT->enablePerfJITDump());
+
+    switch (Bench)
+    {
+    case NoBench:
+        break;
+    case BenchLexer:
+        return RunLexerBenchmark(InputFilename);
+    case BenchAST:
+        return RunASTBenchmark();
+    case BenchParser:
+        return RunParserBenchmark();
+    case BenchREPL:
+        return RunREPLBenchmark();
+    case BenchCache:
+        return RunCacheBenchmark();
+    }
+
+    setInputSource(ExitOnErr(openInputSource(InputFilename)));
 
     // Prime the first token.
-    fprintf(stderr, "ready> ");
+    if (!BatchMode && Emit == EmitNone)
+        fprintf(stderr, "ready> ");
     getNextToken();
 
-    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    InitializeModule();
+
+    // Run the main "interpreter loop" now, or compile the input as a whole.
+    if (Emit != EmitNone)
+        return RunAOT(InputFilename);
+    int Status = 0;
+    if (BatchMode)
+        Status = RunBatch(MapDriverFunction) ? 0 : 1;
+    else
+        MainLoop();
 
-    InitializeModuleAndPassManager();
+    if (!MapDriverFunction.empty() && Status == 0)
+        Status = RunMapDriver();
 
-    // Run the main "interpreter loop" now.
-    MainLoop();
+    if (!ObjectCacheDir.empty())
+        fprintf(stderr, "Object cache: %u hits, %u misses\n",
+                TheJIT->getObjectCache().getNumHits(),
+                TheJIT->getObjectCache().getNumMisses());
 
-    return 0;
+    // Join the compile threads while the state they report back to is alive.
+    clearExprCache();
+    clearMapKernels();
+    SwappableBodies.clear();
+    TheJIT.reset();
+
+    if (!TimingJSON.empty())
+        ExitOnErr(writeTimingJSON());
+
+    return Status;
 }
\ No newline at end of file